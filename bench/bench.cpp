@@ -0,0 +1,252 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+/*
+    Times hot paths over databases of growing size, each size is built
+    from scratch. FileDB ones go to a temporary directory, Gate ones to
+    database path of local library, under build tree
+*/
+
+#include <filedb.hpp>
+#include <libllxgvagate.hpp>
+
+#include <variant.hpp>
+#include <json.hpp>
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <experimental/filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* rounds of each timed operation are scaled down as databases grow */
+#define LLX_GVA_GATE_BENCH_WORK 1000000
+
+#define LLX_GVA_GATE_BENCH_GROUPS 8
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+namespace stdfs=std::experimental::filesystem;
+
+/*
+    Microseconds per call of body
+*/
+template <class F>
+static double measure(size_t rounds, F body)
+{
+    body();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t n=0;n<rounds;n++) {
+        body();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double,std::micro>(end - start).count() / rounds;
+}
+
+static void report(const string& name, size_t users, double us)
+{
+    std::cout<<std::left<<std::setw(24)<<name<<" users="<<std::setw(8)<<users
+             <<std::right<<std::fixed<<std::setprecision(2)<<std::setw(12)<<us<<" us/op"<<std::endl;
+}
+
+static size_t rounds(size_t users)
+{
+    return std::max<size_t>(10,LLX_GVA_GATE_BENCH_WORK / (users * 10));
+}
+
+/*
+    Normalized user database, as Gate stores it
+*/
+static Variant create_database(size_t users)
+{
+    Variant database = Variant::create_struct();
+    database["users"] = Variant::create_array(0);
+    database["groups"] = Variant::create_array(0);
+
+    for (int32_t n=0;n<LLX_GVA_GATE_BENCH_GROUPS;n++) {
+        Variant group = Variant::create_struct();
+        group["name"] = "group" + std::to_string(n);
+        group["gid"] = 2000 + n;
+        database["groups"].append(group);
+    }
+
+    for (size_t n=0;n<users;n++) {
+        string login = "user" + std::to_string(n);
+
+        Variant user = Variant::create_struct();
+        user["login"] = login;
+        user["uid"] = (int32_t)(10000 + n);
+        user["gid"] = (int32_t)2000;
+        user["name"] = "Test";
+        user["surname"] = "User";
+        user["home"] = "/home/" + login;
+        user["shell"] = "/bin/bash";
+        user["groups"] = Variant::create_array(0);
+
+        for (int32_t m=0;m<LLX_GVA_GATE_BENCH_GROUPS;m++) {
+            if ((n + m) % 2 == 0) {
+                user["groups"].append((int32_t)(2000 + m));
+            }
+        }
+
+        database["users"].append(user);
+    }
+
+    return database;
+}
+
+static void create_filedb(FileDB& db, Variant database)
+{
+    db.set_durability(Durability::None);
+    db.create(DBFormat::Bson,0644);
+
+    db.open();
+    db.lock_write();
+    db.write(database);
+    db.unlock();
+    db.close();
+}
+
+/*
+    Whole database through mmap and BSON decoding, parsed anew every time
+    or handed out again while unchanged
+*/
+static void bench_read(const string& dir, size_t users)
+{
+    FileDB db(dir + "/user.db","LLX-USERDB");
+    create_filedb(db,create_database(users));
+
+    report("filedb read",users,measure(rounds(users),[&]() {
+        AutoLock lock(LockMode::Read,&db);
+        db.read();
+    }));
+
+    report("filedb read_shared",users,measure(rounds(users) * 10,[&]() {
+        AutoLock lock(LockMode::Read,&db);
+        string checksum;
+        db.read_shared(checksum);
+    }));
+}
+
+/*
+    Point lookups by login, after first one they are answered from hash
+    indexes built over parsed snapshot
+*/
+static void bench_find(const string& dir, size_t users)
+{
+    FileDB db(dir + "/user.db","LLX-USERDB");
+    create_filedb(db,create_database(users));
+    db.set_keep_open(true);
+
+    vector<string> logins;
+
+    for (size_t n=0;n<users;n+=std::max<size_t>(1,users / 64)) {
+        logins.push_back("user" + std::to_string(n));
+    }
+
+    size_t next = 0;
+
+    report("filedb find",users,measure(LLX_GVA_GATE_BENCH_WORK / 10,[&]() {
+        AutoLock lock(LockMode::Read,&db);
+        Variant out;
+        db.find("users","login",logins[next++ % logins.size()],out);
+    }));
+
+    db.close();
+}
+
+/*
+    Group table with members, as NSS enumerates it. Stored group view is
+    handed out as is, a database unable to hold views has it aggregated
+    from users on every call
+*/
+static void bench_groups(size_t users)
+{
+    stdfs::remove_all(LLX_GVA_GATE_DB_PATH);
+
+    Gate gate([](int priority, string message) {
+        if (priority <= LOG_ERR) {
+            std::cerr<<message;
+        }
+    });
+
+    gate.create_db();
+
+    Variant database = create_database(users);
+    Variant groups = database["groups"];
+    stringstream input;
+
+    for (size_t n=0;n<database["users"].count();n++) {
+        Variant user = database["users"][n];
+        Variant refs = user["groups"];
+
+        user["gid"] = groups[0];
+        user["groups"] = Variant::create_array(0);
+
+        for (size_t m=0;m<refs.count();m++) {
+            user["groups"].append(groups[refs[m].get_int32() - 2000]);
+        }
+
+        json::dump(user,input);
+        input<<"\n";
+    }
+
+    size_t rejected;
+    gate.import_db(input,rejected);
+
+    report("gate get_groups view",users,measure(rounds(users),[&]() {
+        gate.get_groups();
+    }));
+
+    gate.convert_db(DBFormat::Indexed);
+
+    report("gate get_groups build",users,measure(rounds(users),[&]() {
+        gate.get_groups();
+    }));
+
+    stdfs::remove_all(LLX_GVA_GATE_DB_PATH);
+}
+
+int main(int argc, char* argv[])
+{
+    vector<size_t> sizes = {100,10000,100000};
+
+    if (argc > 1) {
+        sizes.clear();
+
+        for (int n=1;n<argc;n++) {
+            sizes.push_back(std::stoul(argv[n]));
+        }
+    }
+
+    for (size_t users : sizes) {
+        char name[] = "/tmp/llx-gva-gate-bench.XXXXXX";
+
+        if (mkdtemp(name) == nullptr) {
+            std::cerr<<"Failed to create temporary directory"<<std::endl;
+            return EXIT_FAILURE;
+        }
+
+        bench_read(name,users);
+        bench_find(name,users);
+        bench_groups(users);
+
+        stdfs::remove_all(name);
+    }
+
+    return EXIT_SUCCESS;
+}
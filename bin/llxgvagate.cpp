@@ -18,6 +18,7 @@
 #include <sys/wait.h>
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <chrono>
 
@@ -78,6 +79,14 @@ void help()
     cout<<"database purge | purge-all"<<endl;
     cout<<"\t\tpurge\tpurges user database"<<endl;
     cout<<"\t\tpurge-all\tpurges both user and cache database"<<endl;
+    cout<<"database compact\t\tfolds pending journal into databases"<<endl;
+    cout<<"database persist [due]\t\tcopies runtime databases to persistent storage"<<endl;
+    cout<<"\t\tdue\tonly once persist_interval has passed"<<endl;
+    cout<<"database restore\t\tsets up runtime databases from persistent storage, at boot"<<endl;
+    cout<<"database stats\t\tshows lock contention counters"<<endl;
+    cout<<"database convert bson | json | indexed"<<endl;
+    cout<<"\t\tconverts user database to given format"<<endl;
+    cout<<"database import FILE\t\tmerges users from a JSON lines file, - for stdin"<<endl;
     cout<<"database su USER\t\tchanges session to given user"<<endl;
 
 }
@@ -155,6 +164,8 @@ int main(int argc,char* argv[])
         assert_root();
 
         Gate gate(log);
+        gate.load_config();
+
         if (!gate.exists_db(true)) {
             gate.create_db();
         }
@@ -179,6 +190,8 @@ int main(int argc,char* argv[])
         }
 
         Gate gate(log);
+        gate.load_config();
+
         if (!gate.exists_db(true)) {
             return EX_DATAERR;
         }
@@ -190,6 +203,7 @@ int main(int argc,char* argv[])
 
     if (cmd == "groups") {
         Gate gate(log);
+        gate.load_config();
 
         if (!gate.exists_db()) {
             /* no need to panic, this may happen */
@@ -218,6 +232,7 @@ int main(int argc,char* argv[])
 
     if (cmd == "users") {
         Gate gate(log);
+        gate.load_config();
 
         if (!gate.exists_db()) {
             /* no need to panic, this may happen */
@@ -244,12 +259,13 @@ int main(int argc,char* argv[])
         assert_setuid();
 
         Gate gate(log);
+        gate.load_config();
+
         if (!gate.exists_db(true)) {
             gate.create_db();
         }
 
         //gate.open();
-        gate.load_config();
 
         string user;
         string password;
@@ -372,6 +388,8 @@ int main(int argc,char* argv[])
             assert_setuid();
 
             Gate gate(log);
+            gate.load_config();
+
             if (!gate.exists_db(true)) {
                 /* no need to panic, this may happen */
                 return EX_OK;
@@ -404,6 +422,8 @@ int main(int argc,char* argv[])
             assert_root();
 
             Gate gate(log);
+            gate.load_config();
+
             if (!gate.exists_db()) {
                 /* no need to panic, this may happen */
                 return EX_OK;
@@ -431,6 +451,7 @@ int main(int argc,char* argv[])
 
         if (cmd2 == "users") {
             Gate gate(log);
+            gate.load_config();
 
             if (!gate.exists_db(true)) {
                 return EX_OK;
@@ -445,6 +466,7 @@ int main(int argc,char* argv[])
             assert_root();
 
             Gate gate(log);
+            gate.load_config();
 
             if (!gate.exists_db(true)) {
                 return EX_OK;
@@ -474,6 +496,8 @@ int main(int argc,char* argv[])
             assert_root();
 
             Gate gate(log);
+            gate.load_config();
+
             if (!gate.exists_db()) {
                 /* no need to panic, this may happen */
                 return EX_OK;
@@ -488,6 +512,179 @@ int main(int argc,char* argv[])
             return EX_OK;
         }
 
+        if (cmd2 == "compact") {
+            assert_root();
+
+            Gate gate(log);
+            gate.load_config();
+
+            if (!gate.exists_db(true)) {
+                return EX_OK;
+            }
+
+            gate.compact_db();
+
+            return EX_OK;
+        }
+
+        if (cmd2 == "stats") {
+            Gate gate(log);
+            gate.load_config();
+
+            if (!gate.exists_db()) {
+                return EX_OK;
+            }
+
+            Variant stats = gate.get_lock_stats();
+            const char* names[] = {"user","shadow"};
+
+            for (const char* name : names) {
+                Variant db = stats[name];
+
+                if (!db.is_struct() or db["locks"].none()) {
+                    cout<<name<<": no counters"<<endl;
+                    continue;
+                }
+
+                int64_t locks = db["locks"].to_int64();
+
+                cout<<name<<":"<<endl;
+                cout<<"\tlocks\t\t"<<locks<<endl;
+                cout<<"\ttimeouts\t"<<db["timeouts"].to_int64()<<endl;
+                cout<<"\twait\t\t"<<db["wait_us"].to_int64()<<" us";
+
+                if (locks > 0) {
+                    cout<<" (avg "<<db["wait_us"].to_int64()/locks<<" us)";
+                }
+
+                cout<<", max "<<db["max_wait_us"].to_int64()<<" us"<<endl;
+                cout<<"\thold\t\t"<<db["hold_us"].to_int64()<<" us";
+
+                if (locks > 0) {
+                    cout<<" (avg "<<db["hold_us"].to_int64()/locks<<" us)";
+                }
+
+                cout<<", max "<<db["max_hold_us"].to_int64()<<" us"<<endl;
+            }
+
+            return EX_OK;
+        }
+
+        if (cmd2 == "persist") {
+            assert_root();
+
+            Gate gate(log);
+            gate.load_config();
+
+            if (!gate.exists_db(true)) {
+                return EX_OK;
+            }
+
+            if (result.args.size() > 3 and result.args[3] == "due") {
+                gate.persist_if_due();
+            }
+            else {
+                gate.persist_db();
+            }
+
+            return EX_OK;
+        }
+
+        if (cmd2 == "restore") {
+            assert_root();
+
+            Gate gate(log);
+            gate.load_config();
+            gate.restore_db();
+
+            return EX_OK;
+        }
+
+        if (cmd2 == "convert") {
+            assert_root();
+
+            if (result.args.size() < 4) {
+                help();
+                return EX_USAGE;
+            }
+
+            DBFormat format;
+            string target = result.args[3];
+
+            if (target == "bson") {
+                format = DBFormat::Bson;
+            }
+            else if (target == "json") {
+                format = DBFormat::Json;
+            }
+            else if (target == "indexed") {
+                format = DBFormat::Indexed;
+            }
+            else {
+                help();
+                return EX_USAGE;
+            }
+
+            Gate gate(log);
+            gate.load_config();
+
+            if (!gate.exists_db()) {
+                return EX_OK;
+            }
+
+            gate.convert_db(format);
+
+            return EX_OK;
+        }
+
+        if (cmd2 == "import") {
+            assert_root();
+
+            if (result.args.size() < 4) {
+                help();
+                return EX_USAGE;
+            }
+
+            string path = result.args[3];
+            ifstream file;
+
+            if (path != "-") {
+                file.open(path);
+
+                if (!file.good()) {
+                    cerr<<"Failed to open "<<path<<endl;
+                    return EX_NOINPUT;
+                }
+            }
+
+            istream& input = (path == "-") ? cin : file;
+
+            Gate gate(log);
+            gate.load_config();
+
+            if (!gate.exists_db(true)) {
+                gate.create_db();
+            }
+
+            std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+
+            size_t rejected = 0;
+            size_t count = gate.import_db(input,rejected);
+
+            std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
+            double secs = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count()/1000.0;
+
+            clog<<"imported "<<count<<" users, "<<rejected<<" rejected, in "<<secs<<" seconds";
+
+            if (secs > 0) {
+                clog<<" ("<<(size_t)(count/secs)<<" users/s)";
+            }
+
+            clog<<endl;
+
+            return (rejected > 0) ? EX_DATAERR : EX_OK;
+        }
+
         help();
         return EX_USAGE;
     }
@@ -0,0 +1,262 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "bsonview.hpp"
+
+#include <variant.hpp>
+
+#include <cstring>
+#include <vector>
+#include <stdexcept>
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+
+static int32_t read_int32(const char* data)
+{
+    int32_t value;
+    std::memcpy(&value,data,4);
+
+    return value;
+}
+
+static void expect(bool condition, const char* what)
+{
+    if (!condition) {
+        throw runtime_error(string("BSON view: ") + what);
+    }
+}
+
+BsonView::BsonView() : element_type(None), data(nullptr), size(0)
+{
+}
+
+BsonView::BsonView(const char* data, size_t size) : element_type(Document), data(data), size(size)
+{
+    expect(size >= 5,"Document too small");
+
+    int32_t len = read_int32(data);
+    expect(len >= 5 and (size_t)len <= size,"Bad document size");
+
+    this->size = len;
+}
+
+BsonView::BsonView(uint8_t type, const char* data, size_t size) : element_type(type), data(data), size(size)
+{
+}
+
+string_view BsonView::get_string() const
+{
+    expect(element_type == String,"Expected String");
+
+    int32_t len = read_int32(data);
+    expect(len >= 1 and (size_t)len + 4 <= size,"Bad string size");
+
+    return string_view(data + 4,len - 1);
+}
+
+int32_t BsonView::get_int32() const
+{
+    expect(element_type == Int32,"Expected Int32");
+
+    return read_int32(data);
+}
+
+size_t BsonView::count() const
+{
+    size_t offset = 0;
+    size_t num = 0;
+    string_view name;
+    BsonView element;
+
+    while (next(offset,name,element)) {
+        num++;
+    }
+
+    return num;
+}
+
+BsonView BsonView::operator[](string_view key) const
+{
+    size_t offset = 0;
+    string_view name;
+    BsonView element;
+
+    if (element_type != Document) {
+        return BsonView();
+    }
+
+    while (next(offset,name,element)) {
+        if (name == key) {
+            return element;
+        }
+    }
+
+    return BsonView();
+}
+
+BsonView BsonView::operator[](size_t index) const
+{
+    size_t offset = 0;
+    size_t num = 0;
+    string_view name;
+    BsonView element;
+
+    if (element_type != Array) {
+        return BsonView();
+    }
+
+    while (next(offset,name,element)) {
+        if (num == index) {
+            return element;
+        }
+
+        num++;
+    }
+
+    return BsonView();
+}
+
+bool BsonView::next(size_t& offset, string_view& name, BsonView& element) const
+{
+    if (element_type != Document and element_type != Array) {
+        return false;
+    }
+
+    if (offset == 0) {
+        offset = 4;
+    }
+
+    expect(offset < size,"Unexpected end of document");
+
+    uint8_t type = (uint8_t)data[offset];
+
+    if (type == 0) {
+        return false;
+    }
+
+    const char* key = data + offset + 1;
+    const char* end = (const char*)std::memchr(key,0,size - offset - 1);
+    expect(end != nullptr,"Unterminated key");
+
+    name = string_view(key,end - key);
+
+    const char* value = end + 1;
+    size_t remain = size - (value - data);
+    size_t len = 0;
+
+    switch (type) {
+        case Double:
+        case Int64:
+        case 0x09: // datetime
+        case 0x11: // timestamp
+            len = 8;
+        break;
+
+        case Int32:
+            len = 4;
+        break;
+
+        case Boolean:
+            len = 1;
+        break;
+
+        case Null:
+        case 0x06: // undefined
+            len = 0;
+        break;
+
+        case 0x07: // object id
+            len = 12;
+        break;
+
+        case 0x13: // decimal128
+            len = 16;
+        break;
+
+        case String:
+            expect(remain >= 4,"Truncated string");
+            len = 4 + (size_t)read_int32(value);
+        break;
+
+        case Binary:
+            expect(remain >= 4,"Truncated binary");
+            len = 5 + (size_t)read_int32(value);
+        break;
+
+        case Document:
+        case Array:
+            expect(remain >= 4,"Truncated document");
+            len = (size_t)read_int32(value);
+            expect(len >= 5,"Bad document size");
+        break;
+
+        default:
+            throw runtime_error("BSON view: Unsupported type");
+    }
+
+    expect(len <= remain,"Truncated element");
+
+    element = BsonView(type,value,len);
+    offset = (value - data) + len;
+
+    return true;
+}
+
+Variant BsonView::to_variant() const
+{
+    switch (element_type) {
+        case Double: {
+            double value;
+            std::memcpy(&value,data,8);
+            return Variant(value);
+        }
+
+        case String:
+            return Variant(string(get_string()));
+
+        case Int32:
+            return Variant(get_int32());
+
+        case Int64: {
+            int64_t value;
+            std::memcpy(&value,data,8);
+            return Variant(value);
+        }
+
+        case Boolean:
+            return Variant((bool)data[0]);
+
+        case Binary: {
+            int32_t len = read_int32(data);
+            const uint8_t* ptr = (const uint8_t*)data + 5;
+            return Variant(std::vector<uint8_t>(ptr,ptr + len));
+        }
+
+        case Document:
+        case Array: {
+            Variant value = (element_type == Array) ? Variant::create_array(0) : Variant::create_struct();
+            size_t offset = 0;
+            string_view name;
+            BsonView element;
+
+            while (next(offset,name,element)) {
+                if (element_type == Array) {
+                    value.append(element.to_variant());
+                }
+                else {
+                    value[string(name)] = element.to_variant();
+                }
+            }
+
+            return value;
+        }
+
+        default:
+            return Variant();
+    }
+}
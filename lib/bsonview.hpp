@@ -0,0 +1,108 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_BSONVIEW
+#define LLX_GVA_GATE_BSONVIEW
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace lliurex
+{
+    /*!
+        Read-only view of a BSON element over a raw buffer. Nothing is
+        decoded until asked for, looking up a field walks element
+        offsets of the enclosing document only
+    */
+    class BsonView
+    {
+        public:
+
+        enum Type {
+            None = 0x00,
+            Double = 0x01,
+            String = 0x02,
+            Document = 0x03,
+            Array = 0x04,
+            Binary = 0x05,
+            Boolean = 0x08,
+            Null = 0x0a,
+            Int32 = 0x10,
+            Int64 = 0x12
+        };
+
+        BsonView();
+
+        /*!
+            View of a whole document, throws if buffer is not big enough
+        */
+        BsonView(const char* data, size_t size);
+
+        uint8_t type() const
+        {
+            return element_type;
+        }
+
+        bool none() const
+        {
+            return element_type == None;
+        }
+
+        bool is_struct() const
+        {
+            return element_type == Document;
+        }
+
+        bool is_array() const
+        {
+            return element_type == Array;
+        }
+
+        bool is_string() const
+        {
+            return element_type == String;
+        }
+
+        bool is_int32() const
+        {
+            return element_type == Int32;
+        }
+
+        std::string_view get_string() const;
+        int32_t get_int32() const;
+
+        /*!
+            Number of elements of a document or array
+        */
+        size_t count() const;
+
+        BsonView operator[](std::string_view key) const;
+        BsonView operator[](size_t index) const;
+
+        /*!
+            Iterates over elements of a document or array, offset
+            should start at zero. Returns false once exhausted
+        */
+        bool next(size_t& offset, std::string_view& name, BsonView& element) const;
+
+        /*!
+            Decodes this element and its children
+        */
+        edupals::variant::Variant to_variant() const;
+
+        protected:
+
+        BsonView(uint8_t type, const char* data, size_t size);
+
+        uint8_t element_type;
+        const char* data;
+        size_t size;
+    };
+}
+
+#endif
@@ -3,6 +3,7 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
 #include "filedb.hpp"
+#include "indexed.hpp"
 
 #include <stdexcept>
 #include <variant.hpp>
@@ -11,7 +12,10 @@
 
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
 #include <syslog.h>
 
 #include <experimental/filesystem>
@@ -19,6 +23,10 @@
 #include <fstream>
 #include <exception>
 #include <sstream>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
 
 using namespace lliurex;
 using namespace edupals;
@@ -27,11 +35,17 @@ using namespace edupals::variant;
 using namespace std;
 namespace stdfs=std::experimental::filesystem;
 
-FileDB::FileDB() : db(nullptr)
+FileDB::FileDB() : durability(Durability::Full), db(nullptr), lock_fd(-1), read_only(true), map_data(nullptr), map_size(0),
+    header(nullptr), snapshot(false), lock_timeout(LLX_GVA_GATE_LOCK_TIMEOUT), hold_us(0),
+    journal_limit(LLX_GVA_GATE_JOURNAL_LIMIT), journal_created(false), keep_open(false)
 {
 }
 
-FileDB::FileDB(string path,string magic) : path(path), format(DBFormat::Bson), db(nullptr), magic(magic)
+FileDB::FileDB(string path,string magic) : format(DBFormat::Bson), durability(Durability::Full), path(path), db(nullptr),
+    lock_fd(-1), read_only(true), magic(magic), map_data(nullptr), map_size(0),
+    header(nullptr), snapshot(false), lock_timeout(LLX_GVA_GATE_LOCK_TIMEOUT), hold_us(0),
+    journal_path(path + ".journal"), pending_path(path + ".pending"), journal_limit(LLX_GVA_GATE_JOURNAL_LIMIT),
+    journal_created(false), keep_open(false)
 {
 
 }
@@ -57,6 +71,7 @@ void FileDB::create(DBFormat format,uint32_t mode)
 {
     this->format = format;
 
+    read_only = false;
     db = fopen(path.c_str(),"wb");
 
     if (!db) {
@@ -66,8 +81,17 @@ void FileDB::create(DBFormat format,uint32_t mode)
     }
 
     int fd = fileno(db);
-    fchmod(fd,mode);
 
+    if (fchmod(fd,mode) != 0) {
+        fclose(db);
+        db = nullptr;
+
+        stringstream ss;
+        ss<<"Failed to set FileDB mode:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    open_lock(false);
     lock_write();
 
     Variant data = Variant::create_struct();
@@ -79,7 +103,13 @@ void FileDB::create(DBFormat format,uint32_t mode)
 
 bool FileDB::open(bool read_only)
 {
+    // a kept read-only handle is not enough for a writer
+    if (db != nullptr and this->read_only and !read_only) {
+        close();
+    }
+
     if (db == nullptr) {
+        this->read_only = read_only;
         const char* rw = "r+";
         const char* ro = "r";
         const char* options = (read_only) ? ro : rw;
@@ -87,18 +117,10 @@ bool FileDB::open(bool read_only)
 
 
         if (db) {
-            uint32_t header;
-            size_t status = fread(&header,4,1,db);
-
-            if (status == 1) {
-                fseek(db, 0, SEEK_END);
-
-                if (ftell(db) == header) {
-                    format = DBFormat::Bson;
-                }
-            }
-
+            guess_format();
             fseek(db,0,SEEK_SET);
+
+            open_lock(read_only);
         }
 
     }
@@ -108,41 +130,135 @@ bool FileDB::open(bool read_only)
 
 void FileDB::close()
 {
+    unmap();
+    unmap_header();
+    snapshot = false;
+
     if (db != nullptr) {
         fclose(db);
         db = nullptr;
     }
+
+    if (lock_fd != -1) {
+        ::close(lock_fd);
+        lock_fd = -1;
+    }
 }
 
 void FileDB::lock_read()
 {
-    int fd = fileno(db);
-    int status = flock(fd,LOCK_SH);
-
-    if (status != 0) {
-        stringstream ss;
-        ss<<"Failed to lock for read FileDB:"<<path;
-        throw runtime_error(ss.str());
+    if (header != nullptr) {
+        // snapshot is picked and validated by read() and find()
+        snapshot = true;
+        return;
     }
 
+    acquire(LOCK_SH);
+    reopen();
+}
+
+void FileDB::lock_shared()
+{
+    acquire(LOCK_SH);
+    reopen();
 }
 
 void FileDB::lock_write()
 {
-    int fd = fileno(db);
-    int status = flock(fd,LOCK_EX);
+    acquire(LOCK_EX);
 
-    if (status != 0) {
-        stringstream ss;
-        ss<<"Failed to lock for write FileDB:"<<path;
-        throw runtime_error(ss.str());
+    // a writer died in the middle of a commit, we are the only one now
+    if (header != nullptr and (__atomic_load_n(&header->generation,__ATOMIC_ACQUIRE) & 1)) {
+        __atomic_add_fetch(&header->generation,1,__ATOMIC_RELEASE);
     }
 
+    reopen();
 }
 
 void FileDB::unlock()
 {
-    int fd = fileno(db);
+    if (snapshot) {
+        snapshot = false;
+        return;
+    }
+
+    release();
+}
+
+/*!
+    flock with a deadline in milliseconds, zero waits forever. Returns
+    false once deadline passes
+*/
+static bool bounded_flock(int fd, int operation, int32_t timeout, const string& path)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    useconds_t backoff = 1000;
+
+    while (flock(fd,operation | LOCK_NB) != 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno != EWOULDBLOCK) {
+            stringstream ss;
+            ss<<"Failed to lock FileDB:"<<path;
+            throw runtime_error(ss.str());
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (timeout > 0 and now >= deadline) {
+            return false;
+        }
+
+        // back off up to 50ms, but never past deadline
+        useconds_t wait = backoff;
+
+        if (timeout > 0) {
+            auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+            wait = std::min<useconds_t>(wait,left);
+        }
+
+        usleep(wait);
+        backoff = std::min<useconds_t>(backoff * 2,50000);
+    }
+
+    return true;
+}
+
+void FileDB::acquire(int operation)
+{
+    int fd = (lock_fd != -1) ? lock_fd : fileno(db);
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (!bounded_flock(fd,operation,lock_timeout,path)) {
+        if (header != nullptr and !read_only) {
+            __atomic_add_fetch(&header->timeouts,1,__ATOMIC_RELAXED);
+        }
+
+        stringstream ss;
+        ss<<"Timed out waiting for FileDB lock:"<<path;
+        throw exception::LockTimeout(ss.str());
+    }
+
+    locked_at = std::chrono::steady_clock::now();
+
+    if (header != nullptr and !read_only) {
+        uint64_t waited = std::chrono::duration_cast<std::chrono::microseconds>(locked_at - start).count();
+
+        __atomic_add_fetch(&header->locks,1,__ATOMIC_RELAXED);
+        __atomic_add_fetch(&header->wait_us,waited,__ATOMIC_RELAXED);
+
+        if (waited > __atomic_load_n(&header->max_wait_us,__ATOMIC_RELAXED)) {
+            __atomic_store_n(&header->max_wait_us,waited,__ATOMIC_RELAXED);
+        }
+    }
+}
+
+void FileDB::release()
+{
+    int fd = (lock_fd != -1) ? lock_fd : fileno(db);
     int status = flock(fd,LOCK_UN);
 
     if (status != 0) {
@@ -151,22 +267,178 @@ void FileDB::unlock()
         throw runtime_error(ss.str());
     }
 
+    auto now = std::chrono::steady_clock::now();
+    uint64_t held = std::chrono::duration_cast<std::chrono::microseconds>(now - locked_at).count();
+
+    hold_us = held;
+
+    if (header != nullptr and !read_only) {
+        __atomic_add_fetch(&header->hold_us,held,__ATOMIC_RELAXED);
+
+        if (held > __atomic_load_n(&header->max_hold_us,__ATOMIC_RELAXED)) {
+            __atomic_store_n(&header->max_hold_us,held,__ATOMIC_RELAXED);
+        }
+    }
+}
+
+Variant FileDB::lock_stats()
+{
+    Variant stats = Variant::create_struct();
+
+    if (header == nullptr) {
+        return stats;
+    }
+
+    stats["locks"] = (int64_t)__atomic_load_n(&header->locks,__ATOMIC_RELAXED);
+    stats["timeouts"] = (int64_t)__atomic_load_n(&header->timeouts,__ATOMIC_RELAXED);
+    stats["wait_us"] = (int64_t)__atomic_load_n(&header->wait_us,__ATOMIC_RELAXED);
+    stats["max_wait_us"] = (int64_t)__atomic_load_n(&header->max_wait_us,__ATOMIC_RELAXED);
+    stats["hold_us"] = (int64_t)__atomic_load_n(&header->hold_us,__ATOMIC_RELAXED);
+    stats["max_hold_us"] = (int64_t)__atomic_load_n(&header->max_hold_us,__ATOMIC_RELAXED);
+
+    return stats;
 }
 
 edupals::variant::Variant FileDB::read()
 {
+    string checksum;
 
-    stringstream ss;
-    char buffer[128];
-    size_t len;
+    return read(checksum);
+}
+
+edupals::variant::Variant FileDB::read(string& checksum)
+{
+    Variant data;
+
+    consistent([&]() {
+        data = load(checksum);
+        replay(data);
+    });
+
+    return data;
+}
+
+edupals::variant::Variant FileDB::read_shared(string& checksum)
+{
+    Variant data;
+
+    consistent([&]() {
+        /*
+            key is taken before parsing, an append racing us only costs
+            one more parse on next call
+        */
+        SnapshotKey key = snapshot_key();
+
+        if (key != shared_key) {
+            load_shared(key);
+        }
+
+        data = shared_data;
+        checksum = shared_checksum;
+    });
+
+    return data;
+}
+
+/*!
+    Identity of base file and journal, base files are never modified in
+    place and journal only grows until it is folded
+*/
+SnapshotKey FileDB::snapshot_key()
+{
+    SnapshotKey key;
+    struct stat st;
+
+    if (fstat(fileno(db),&st) != 0) {
+        return key;
+    }
+
+    key.valid = true;
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtim = st.st_mtim;
+
+    key.journal = (stat(journal_path.c_str(),&st) == 0);
+
+    if (key.journal) {
+        key.journal_ino = st.st_ino;
+        key.journal_size = st.st_size;
+        key.journal_mtim = st.st_mtim;
+    }
+
+    return key;
+}
+
+void FileDB::load_shared(const SnapshotKey& key)
+{
+    shared_data = load(shared_checksum);
+    replay(shared_data);
+    shared_key = key;
+    shared_index.clear();
+}
+
+/*!
+    Indexes are built on first use, one per collection and field. When a
+    key is repeated first record wins, as in a linear scan
+*/
+bool FileDB::find_shared(const string& collection, const string& field, const string& key, Variant& out)
+{
+    auto& fields = shared_index[collection];
+    auto index = fields.find(field);
+
+    if (index == fields.end()) {
+        index = fields.emplace(field,unordered_map<string,size_t>()).first;
+        Variant items = shared_data[collection];
+
+        if (items.is_array()) {
+            for (size_t n=0;n<items.count();n++) {
+                Variant value = items[n][field];
+
+                if (value.is_string()) {
+                    index->second.emplace(value.get_string(),n);
+                }
+            }
+        }
+    }
+
+    auto entry = index->second.find(key);
+
+    if (entry == index->second.end()) {
+        return false;
+    }
+
+    out = shared_data[collection][entry->second];
+
+    return true;
+}
+
+Variant FileDB::load()
+{
+    string checksum;
+
+    return load(checksum);
+}
+
+Variant FileDB::load(string& checksum)
+{
+    map();
+
+    checksum = "";
+
+    if (format == DBFormat::Indexed) {
+        indexed::Reader reader(map_data,map_size);
+
+        if (reader.magic() != magic) {
+            throw runtime_error("FileDB read: Bad MAGIC");
+        }
 
-    L0:
-    len = fread(buffer,1,128,db);
-    if (len > 0) {
-        ss.write((const char*)buffer,len);
-        goto L0;
+        return reader.load();
     }
 
+    MemoryBuffer buffer(map_data,map_size);
+    istream ss(&buffer);
+
     Variant value;
 
     if (format == DBFormat::Json) {
@@ -177,9 +449,6 @@ edupals::variant::Variant FileDB::read()
          value = bson::load(ss);
     }
 
-    stringstream so;
-    so<<value;
-
     if (!value.is_struct()) {
         throw runtime_error("FileDB read: Expected struct");
     }
@@ -188,62 +457,1497 @@ edupals::variant::Variant FileDB::read()
         throw runtime_error("FileDB read: Bad MAGIC");
     }
 
+    if (value["checksum"].is_string()) {
+        checksum = value["checksum"].get_string();
+    }
+
     return value["data"];
 }
 
-void FileDB::write(edupals::variant::Variant data)
+/*!
+    FNV-1a over BSON encoding of data, so it does not depend on the
+    format the database is stored with
+*/
+static string data_checksum(Variant data)
 {
     stringstream ss(std::stringstream::out | std::stringstream::binary);
-    //std::stringbuf buffer;
-    //std::ostream ss(&buffer);
+    bson::dump(data,ss);
+    const string& buffer = ss.str();
 
-    Variant header;
-    header = Variant::create_struct();
-    header["magic"] = magic;
-    header["data"] = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
 
-    if (format == DBFormat::Json) {
-        json::dump(header,ss);
+    for (unsigned char c : buffer) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
     }
 
-    if (format == DBFormat::Bson) {
-        bson::dump(header,ss);
+    char tmp[17];
+    snprintf(tmp,sizeof(tmp),"%016llx",(unsigned long long)hash);
+
+    return string(tmp);
+}
+
+/*!
+    fsync directory holding file, so a rename or a creation is durable
+*/
+static void sync_parent(const string& file)
+{
+    const stdfs::path dbpath {file};
+    int dir = ::open(dbpath.parent_path().c_str(),O_RDONLY | O_DIRECTORY);
+
+    if (dir >= 0) {
+        fsync(dir);
+        ::close(dir);
     }
+}
 
-    fseek(db,0,SEEK_SET);
-    int fd = fileno(db);
-    ftruncate(fd,0);
+/*!
+    Returns the size of the sequence of complete BSON documents at the
+    beginning of buffer. Anything past it is a torn append.
+*/
+static size_t journal_end(const char* data, size_t size)
+{
+    size_t offset = 0;
 
-    int status = fwrite(ss.str().c_str(),ss.str().size(),1,db);
+    while (size - offset >= 5) {
+        int32_t len;
+        std::memcpy(&len,data + offset,4);
 
-    if (status == 0) {
-        stringstream ss;
-        ss<<"Failed to write FileDB:"<<path;
-        throw runtime_error(ss.str());
+        if (len < 5 or (size_t)len > (size - offset)) {
+            break;
+        }
+
+        offset += len;
+    }
+
+    return offset;
+}
+
+/*!
+    A journal starts with a marker record naming the base file it was
+    appended over. Returns offset of first update, stale is set when
+    journal belongs to another base file. Journals written by older
+    versions have no marker and always apply
+*/
+static size_t journal_start(const char* data, size_t end, const string& base, bool& stale)
+{
+    stale = false;
+
+    if (end == 0) {
+        return 0;
+    }
+
+    int32_t len;
+    std::memcpy(&len,data,4);
+
+    BsonView record(data,len);
+
+    if (record["op"].get_string() != "base") {
+        return 0;
     }
 
-    syncfs(fd);
+    stale = (record["base"].get_string() != base);
 
+    return len;
 }
 
-void FileDB::guess_format()
+/*!
+    Whether two records share the value of any unique field
+*/
+static bool collides(Variant unique, Variant a, Variant b)
 {
-    uint32_t data;
-    size_t len;
+    if (!unique.is_array() or !a.is_struct() or !b.is_struct()) {
+        return false;
+    }
 
-    fseek(db,0,SEEK_SET);
-    len = fread(&data,sizeof(uint32_t),1,db);
+    for (size_t n=0;n<unique.count();n++) {
+        string name = unique[n].get_string();
+        Variant va = a[name];
+        Variant vb = b[name];
 
-    if (len != 1) {
-        //TODO
+        if (va.is_int32() and vb.is_int32() and va.get_int32() == vb.get_int32()) {
+            return true;
+        }
+
+        if (va.is_string() and vb.is_string() and va.get_string() == vb.get_string()) {
+            return true;
+        }
     }
 
-    if (data == '{') {
-        format = DBFormat::Json;
+    return false;
+}
+
+bool FileDB::find(const string& collection, const string& field, const string& key, Variant& out)
+{
+    bool found = false;
+
+    consistent([&]() {
+        SnapshotKey current = snapshot_key();
+
+        /*
+            a single lookup is cheaper walking raw records, a snapshot is
+            only parsed and indexed once it is queried again
+        */
+        if (current == shared_key or current == probed_key) {
+            if (current != shared_key) {
+                load_shared(current);
+            }
+
+            found = find_shared(collection,field,key,out);
+        }
+        else {
+            probed_key = current;
+            found = lookup(collection,field,key,out);
+        }
+    });
+
+    return found;
+}
+
+bool FileDB::lookup(const string& collection, const string& field, const string& key, Variant& out)
+{
+    bool found = find_base(collection,field,key,out);
+
+    // journal is applied in order over base record
+    scan_journal([&](BsonView record) {
+        if (record["collection"].get_string() != collection) {
+            return;
+        }
+
+        bool upsert = (record["op"].get_string() == "upsert");
+
+        if (record["field"].get_string() == field and record["key"].get_string() == key) {
+            found = upsert;
+
+            if (found) {
+                out = record["value"].to_variant();
+            }
+
+            return;
+        }
+
+        if (upsert and found and !record["unique"].none()) {
+            if (collides(record["unique"].to_variant(),record["value"].to_variant(),out)) {
+                found = false;
+            }
+        }
+    });
+
+    return found;
+}
+
+bool FileDB::find_base(const string& collection, const string& field, const string& key, Variant& out)
+{
+    map();
+
+    if (format == DBFormat::Indexed and collection == "users" and field == "login") {
+        indexed::Reader reader(map_data,map_size);
+        int64_t index = reader.find_login(key);
+
+        if (index < 0) {
+            return false;
+        }
+
+        out = reader.user(index);
+
+        return true;
+    }
+
+    if (format == DBFormat::Indexed and collection == "groups" and field == "name") {
+        indexed::Reader reader(map_data,map_size);
+        int64_t index = reader.find_group(key);
+
+        if (index < 0) {
+            return false;
+        }
+
+        out = reader.group(index);
+
+        return true;
+    }
+
+    if (format == DBFormat::Bson) {
+        /*
+            walk raw records and only decode the matching one, the rest
+            are skipped by their size
+        */
+        BsonView root(map_data,map_size);
+
+        if (root["magic"].get_string() != magic) {
+            throw runtime_error("FileDB read: Bad MAGIC");
+        }
+
+        BsonView items = root["data"][collection];
+        size_t offset = 0;
+        string_view name;
+        BsonView item;
+
+        while (items.next(offset,name,item)) {
+            BsonView value = item[field];
+
+            if (value.is_string() and value.get_string() == key) {
+                out = item.to_variant();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    Variant data = load();
+
+    if (!data.is_struct() or !data[collection].is_array()) {
+        return false;
+    }
+
+    Variant items = data[collection];
+
+    for (size_t n=0;n<items.count();n++) {
+        Variant item = items[n];
+
+        if (item[field].is_string() and item[field].get_string() == key) {
+            out = item;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+string FileDB::encode(Variant data)
+{
+    stringstream ss(std::stringstream::out | std::stringstream::binary);
+
+    if (format == DBFormat::Indexed) {
+        indexed::dump(magic,data,ss);
     }
     else {
-        // improve this
-        format = DBFormat::Bson;
+        Variant header;
+        header = Variant::create_struct();
+        header["magic"] = magic;
+        header["checksum"] = data_checksum(data);
+        header["data"] = data;
+
+        if (format == DBFormat::Json) {
+            json::dump(header,ss);
+        }
+
+        if (format == DBFormat::Bson) {
+            bson::dump(header,ss);
+        }
+    }
+
+    return ss.str();
+}
+
+string FileDB::write_temp(string target, const string& buffer, bool sync)
+{
+    struct stat st;
+    fstat(fileno(db),&st);
+
+    static std::atomic<uint32_t> counter(0);
+
+    // rewrite() builds it without any lock, so names can not clash
+    string tmp_path = target + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+    int fd = ::open(tmp_path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,st.st_mode & 07777);
+
+    if (fd < 0) {
+        stringstream ss;
+        ss<<"Failed to create FileDB temporary file:"<<tmp_path;
+        throw runtime_error(ss.str());
+    }
+
+    // a file left with our owner and umask would lock readers out once renamed
+    if (fchown(fd,st.st_uid,st.st_gid) != 0 or fchmod(fd,st.st_mode & 07777) != 0) {
+        ::close(fd);
+        unlink(tmp_path.c_str());
+
+        stringstream ss;
+        ss<<"Failed to set FileDB owner and mode:"<<tmp_path;
+        throw runtime_error(ss.str());
+    }
+
+    const char* ptr = buffer.c_str();
+    size_t remain = buffer.size();
+
+    while (remain > 0) {
+        ssize_t len = ::write(fd,ptr,remain);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ::close(fd);
+            unlink(tmp_path.c_str());
+
+            stringstream ss;
+            ss<<"Failed to write FileDB:"<<target;
+            throw runtime_error(ss.str());
+        }
+
+        ptr += len;
+        remain -= len;
+    }
+
+    if (sync) {
+        fsync(fd);
+    }
+
+    ::close(fd);
+
+    return tmp_path;
+}
+
+void FileDB::write(edupals::variant::Variant data)
+{
+    /*
+        New content goes to a temporary file that is renamed over the live
+        one, so a reader either maps the old snapshot or the new one, and a
+        crash never leaves a torn database behind
+    */
+    string tmp_path = write_temp(path,encode(data),durability != Durability::None);
+
+    swap_in(tmp_path);
+
+    if (durability == Durability::Full) {
+        sync_dir();
+    }
+}
+
+void FileDB::swap_in(string tmp_path)
+{
+    /*
+        a reader could map old file and then find journal already gone, so
+        file swap and journal removal are fenced by generation
+    */
+    begin_commit();
+
+    if (rename(tmp_path.c_str(),path.c_str()) != 0) {
+        end_commit();
+        unlink(tmp_path.c_str());
+
+        stringstream ss;
+        ss<<"Failed to commit FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    /*
+        journal is folded into new snapshot. If we crash before unlinking
+        it, its marker names old base file and it is ignored from now on
+    */
+    unlink(journal_path.c_str());
+
+    end_commit();
+
+    // a deferred journal is gone with the fold
+    journal_created = false;
+
+    // handle still points to old snapshot
+    reopen();
+}
+
+void FileDB::rewrite(function<Variant(Variant)> update)
+{
+    bool was_open = is_open();
+
+    open(false);
+
+    try {
+        bool done = false;
+
+        for (size_t n=0;n<LLX_GVA_GATE_REWRITE_RETRIES and !done;n++) {
+            done = try_rewrite(update);
+        }
+
+        // writers keep racing us, do it the old way
+        if (!done) {
+            lock_write();
+
+            try {
+                string tmp_path = write_temp(path,encode(update(read())),durability != Durability::None);
+                swap_in(tmp_path);
+            }
+            catch (std::exception& e) {
+                unlock();
+                throw;
+            }
+
+            unlock();
+
+            if (durability == Durability::Full) {
+                sync_dir();
+            }
+        }
+    }
+    catch (std::exception& e) {
+        if (!was_open and !keep_open) {
+            close();
+        }
+
+        throw;
+    }
+
+    if (!was_open and !keep_open) {
+        close();
+    }
+}
+
+/*!
+    One optimistic attempt, returns false if a commit got in between
+*/
+bool FileDB::try_rewrite(function<Variant(Variant)> update)
+{
+    SnapshotKey key;
+    Variant data;
+
+    lock_read();
+
+    try {
+        consistent([&]() {
+            key = snapshot_key();
+            data = load();
+            replay(data);
+        });
+    }
+    catch (std::exception& e) {
+        unlock();
+        throw;
+    }
+
+    unlock();
+
+    string tmp_path = write_temp(path,encode(update(data)),durability != Durability::None);
+
+    lock_write();
+
+    // same base file and journal as we read, nobody committed meanwhile
+    if (snapshot_key() != key) {
+        unlock();
+        unlink(tmp_path.c_str());
+
+        return false;
+    }
+
+    try {
+        swap_in(tmp_path);
+    }
+    catch (std::exception& e) {
+        unlock();
+        throw;
+    }
+
+    unlock();
+
+    if (durability == Durability::Full) {
+        sync_dir();
+    }
+
+    return true;
+}
+
+void FileDB::persist()
+{
+    if (backing_path.size() == 0) {
+        return;
+    }
+
+    // backing copy is the only durable one, so it is always synced
+    string tmp_path = write_temp(backing_path,encode(read()),true);
+
+    if (rename(tmp_path.c_str(),backing_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+
+        stringstream ss;
+        ss<<"Failed to persist FileDB:"<<backing_path;
+        throw runtime_error(ss.str());
+    }
+
+    sync_parent(backing_path);
+}
+
+bool FileDB::restore()
+{
+    if (backing_path.size() == 0) {
+        return false;
+    }
+
+    const stdfs::path source {backing_path};
+    const stdfs::path target {path};
+
+    if (!stdfs::exists(source)) {
+        return false;
+    }
+
+    stdfs::create_directories(target.parent_path());
+
+    // stale journal would be replayed over a snapshot it does not belong to
+    unlink(journal_path.c_str());
+    unlink(pending_path.c_str());
+
+    string tmp_path = path + ".tmp";
+    const stdfs::path tmp {tmp_path};
+
+    stdfs::copy_file(source,tmp,stdfs::copy_options::overwrite_existing);
+
+    struct stat st;
+
+    if (stat(backing_path.c_str(),&st) == 0) {
+        if (chown(tmp_path.c_str(),st.st_uid,st.st_gid) != 0 or chmod(tmp_path.c_str(),st.st_mode & 07777) != 0) {
+            unlink(tmp_path.c_str());
+
+            stringstream ss;
+            ss<<"Failed to set FileDB owner and mode:"<<tmp_path;
+            throw runtime_error(ss.str());
+        }
+    }
+
+    if (rename(tmp_path.c_str(),path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+
+        stringstream ss;
+        ss<<"Failed to restore FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    return true;
+}
+
+string FileDB::queue_upsert(string collection, string field, string key, Variant value, vector<string> unique)
+{
+    Variant record = Variant::create_struct();
+    record["op"] = "upsert";
+    record["collection"] = collection;
+    record["field"] = field;
+    record["key"] = key;
+    record["value"] = value;
+
+    if (unique.size() > 0) {
+        Variant fields = Variant::create_array(0);
+
+        for (string& name : unique) {
+            fields.append(name);
+        }
+
+        record["unique"] = fields;
+    }
+
+    return queue(record);
+}
+
+string FileDB::queue_remove(string collection, string field, string key)
+{
+    Variant record = Variant::create_struct();
+    record["op"] = "delete";
+    record["collection"] = collection;
+    record["field"] = field;
+    record["key"] = key;
+
+    return queue(record);
+}
+
+void FileDB::upsert(string collection, string field, string key, Variant value, vector<string> unique)
+{
+    commit(queue_upsert(collection,field,key,value,unique));
+}
+
+void FileDB::remove(string collection, string field, string key)
+{
+    commit(queue_remove(collection,field,key));
+}
+
+string FileDB::queue(Variant record)
+{
+    static uint32_t counter = 0;
+
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    string ticket = std::to_string(getpid()) + "." +
+                    std::to_string(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()) + "." +
+                    std::to_string(counter++);
+
+    record["ticket"] = ticket;
+
+    stringstream ss(std::stringstream::out | std::stringstream::binary);
+    bson::dump(record,ss);
+    const string& buffer = ss.str();
+
+    struct stat st;
+
+    if (stat(path.c_str(),&st) != 0) {
+        stringstream ss;
+        ss<<"Failed to stat FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    int fd;
+
+    while (true) {
+        fd = ::open(pending_path.c_str(),O_RDWR | O_CREAT | O_APPEND,st.st_mode & 07777);
+
+        if (fd < 0) {
+            stringstream ss;
+            ss<<"Failed to open FileDB queue:"<<pending_path;
+            throw runtime_error(ss.str());
+        }
+
+        lock_queue(fd);
+
+        // committed records may have been dropped by renaming a new queue over it
+        struct stat fst;
+        struct stat pst;
+
+        if (fstat(fd,&fst) == 0 and stat(pending_path.c_str(),&pst) == 0 and
+            fst.st_dev == pst.st_dev and fst.st_ino == pst.st_ino) {
+            break;
+        }
+
+        flock(fd,LOCK_UN);
+        ::close(fd);
+    }
+
+    ssize_t len = ::write(fd,buffer.c_str(),buffer.size());
+
+    flock(fd,LOCK_UN);
+    ::close(fd);
+
+    if (len != (ssize_t)buffer.size()) {
+        stringstream ss;
+        ss<<"Failed to queue FileDB update:"<<pending_path;
+        throw runtime_error(ss.str());
+    }
+
+    return ticket;
+}
+
+/*!
+    Queue lock is only held while appending or draining, never while a
+    writer waits for disk, so it shares database lock deadline
+*/
+void FileDB::lock_queue(int fd)
+{
+    try {
+        if (bounded_flock(fd,LOCK_EX,lock_timeout,pending_path)) {
+            return;
+        }
+    }
+    catch (std::exception& e) {
+        ::close(fd);
+        throw;
+    }
+
+    ::close(fd);
+
+    stringstream ss;
+    ss<<"Timed out waiting for FileDB queue:"<<pending_path;
+    throw exception::LockTimeout(ss.str());
+}
+
+size_t FileDB::commit(string ticket, bool sync)
+{
+    int fd = ::open(pending_path.c_str(),O_RDWR);
+
+    if (fd < 0) {
+        // nothing queued at all
+        return 0;
+    }
+
+    lock_queue(fd);
+
+    struct stat st;
+    fstat(fd,&st);
+
+    size_t count = 0;
+    bool pending = false;
+    string batch;
+    void* ptr = MAP_FAILED;
+
+    if (st.st_size > 0) {
+        ptr = mmap(nullptr,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    }
+
+    if (ptr != MAP_FAILED) {
+        const char* queue = (const char*)ptr;
+        size_t end = journal_end(queue,st.st_size);
+        size_t offset = 0;
+
+        while (offset < end) {
+            int32_t len;
+            std::memcpy(&len,queue + offset,4);
+
+            BsonView record(queue + offset,len);
+            offset += len;
+            count++;
+
+            if (record["ticket"].get_string() == ticket) {
+                pending = true;
+            }
+        }
+
+        /*
+            whoever holds database lock commits the whole batch, it stays
+            queued until it is in journal
+        */
+        if (pending) {
+            batch = string(queue,end);
+        }
+
+        munmap(ptr,st.st_size);
+    }
+
+    // queuers go on while batch reaches disk
+    flock(fd,LOCK_UN);
+    ::close(fd);
+
+    if (!pending) {
+        return 0;
+    }
+
+    /*
+        if we fail or die from here on, batch is still first in queue and
+        next committer appends it again. Replaying it twice is harmless,
+        anything queued later comes after it both times
+    */
+    append(batch,sync);
+    dequeue(batch.size());
+
+    return count;
+}
+
+void FileDB::dequeue(size_t size)
+{
+    int fd = ::open(pending_path.c_str(),O_RDWR);
+
+    if (fd < 0) {
+        stringstream ss;
+        ss<<"Failed to open FileDB queue:"<<pending_path;
+        throw runtime_error(ss.str());
+    }
+
+    lock_queue(fd);
+
+    struct stat st;
+    fstat(fd,&st);
+
+    // queuers only append, committed batch is still its head
+    string rest;
+
+    if ((size_t)st.st_size > size) {
+        rest.resize(st.st_size - size);
+
+        if (pread(fd,&rest[0],rest.size(),size) != (ssize_t)rest.size()) {
+            flock(fd,LOCK_UN);
+            ::close(fd);
+
+            stringstream ss;
+            ss<<"Failed to read FileDB queue:"<<pending_path;
+            throw runtime_error(ss.str());
+        }
+    }
+
+    /*
+        new queue is renamed over, a crash leaves either whole old one or
+        whole new one. Queuers waiting on old file notice and reopen
+    */
+    try {
+        string tmp_path = write_temp(pending_path,rest,false);
+
+        if (rename(tmp_path.c_str(),pending_path.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+
+            stringstream ss;
+            ss<<"Failed to drain FileDB queue:"<<pending_path;
+            throw runtime_error(ss.str());
+        }
+    }
+    catch (std::exception& e) {
+        flock(fd,LOCK_UN);
+        ::close(fd);
+        throw;
+    }
+
+    flock(fd,LOCK_UN);
+    ::close(fd);
+}
+
+void FileDB::compact()
+{
+    Variant data = read();
+    write(data);
+}
+
+bool FileDB::compact_if_due()
+{
+    struct stat jst;
+
+    if (stat(journal_path.c_str(),&jst) != 0 or (size_t)jst.st_size <= journal_limit) {
+        return false;
+    }
+
+    bool was_open = is_open();
+    bool done = false;
+
+    open(false);
+
+    try {
+        done = try_rewrite([](Variant data) {
+            return data;
+        });
+    }
+    catch (std::exception& e) {
+        if (!was_open and !keep_open) {
+            close();
+        }
+
+        throw;
+    }
+
+    if (!was_open and !keep_open) {
+        close();
+    }
+
+    return done;
+}
+
+void FileDB::guess_format()
+{
+    uint32_t data;
+    size_t len;
+
+    fseek(db,0,SEEK_SET);
+    len = fread(&data,sizeof(uint32_t),1,db);
+
+    if (len != 1) {
+        // empty or truncated, keep current format
+        return;
+    }
+
+    fseek(db,0,SEEK_END);
+    long size = ftell(db);
+
+    if (data == indexed::Signature) {
+        format = DBFormat::Indexed;
+    }
+    else if (size == data) {
+        // bson documents start with their own size
+        format = DBFormat::Bson;
+    }
+    else if ((data & 0xff) == '{') {
+        format = DBFormat::Json;
+    }
+}
+
+void FileDB::map()
+{
+    if (map_data != nullptr) {
+        return;
+    }
+
+    int fd = fileno(db);
+    struct stat st;
+
+    if (fstat(fd,&st) != 0) {
+        stringstream ss;
+        ss<<"Failed to stat FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    if (st.st_size == 0) {
+        stringstream ss;
+        ss<<"Empty FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    void* ptr = mmap(nullptr,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+
+    if (ptr == MAP_FAILED) {
+        stringstream ss;
+        ss<<"Failed to map FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    madvise(ptr,st.st_size,MADV_SEQUENTIAL);
+
+    map_data = (const char*)ptr;
+    map_size = st.st_size;
+}
+
+void FileDB::unmap()
+{
+    if (map_data != nullptr) {
+        munmap((void*)map_data,map_size);
+        map_data = nullptr;
+        map_size = 0;
+    }
+}
+
+void FileDB::open_lock(bool read_only)
+{
+    if (lock_fd != -1) {
+        return;
+    }
+
+    string lock_path = path + ".lock";
+
+    if (read_only) {
+        lock_fd = ::open(lock_path.c_str(),O_RDONLY);
+    }
+    else {
+        lock_fd = ::open(lock_path.c_str(),O_RDWR | O_CREAT,S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+
+    /*
+        Missing lock file and no permission to create it: lock database file
+        itself as older versions did
+    */
+    if (lock_fd != -1) {
+        map_header(read_only);
+    }
+}
+
+void FileDB::map_header(bool read_only)
+{
+    struct stat st;
+
+    if (fstat(lock_fd,&st) != 0) {
+        return;
+    }
+
+    if (st.st_size < (off_t)sizeof(LockHeader)) {
+        // lock file from an older version, readers keep using flock
+        if (read_only or ftruncate(lock_fd,sizeof(LockHeader)) != 0) {
+            return;
+        }
+    }
+
+    int prot = (read_only) ? PROT_READ : PROT_READ | PROT_WRITE;
+    void* ptr = mmap(nullptr,sizeof(LockHeader),prot,MAP_SHARED,lock_fd,0);
+
+    if (ptr != MAP_FAILED) {
+        header = (LockHeader*)ptr;
+    }
+}
+
+void FileDB::unmap_header()
+{
+    if (header != nullptr) {
+        munmap(header,sizeof(LockHeader));
+        header = nullptr;
+    }
+}
+
+void FileDB::begin_commit()
+{
+    if (header != nullptr and !read_only) {
+        __atomic_add_fetch(&header->generation,1,__ATOMIC_SEQ_CST);
+    }
+}
+
+void FileDB::end_commit()
+{
+    if (header != nullptr and !read_only) {
+        __atomic_add_fetch(&header->generation,1,__ATOMIC_RELEASE);
+    }
+}
+
+void FileDB::consistent(function<void()> body)
+{
+    if (!snapshot) {
+        body();
+        return;
+    }
+
+    for (size_t n=0;n<LLX_GVA_GATE_SNAPSHOT_RETRIES;n++) {
+        uint64_t start = __atomic_load_n(&header->generation,__ATOMIC_ACQUIRE);
+
+        if (start & 1) {
+            // a rename is in flight, it only takes a moment
+            sched_yield();
+            continue;
+        }
+
+        reopen();
+        body();
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&header->generation,__ATOMIC_ACQUIRE) == start) {
+            return;
+        }
+    }
+
+    /*
+        generation stuck odd after a crashed writer, or writers keep
+        racing us: wait for them as older versions did
+    */
+    acquire(LOCK_SH);
+
+    try {
+        reopen();
+        body();
+    }
+    catch (std::exception& e) {
+        release();
+        throw;
+    }
+
+    release();
+}
+
+void FileDB::reopen()
+{
+    struct stat current;
+    struct stat st;
+
+    if (fstat(fileno(db),&current) != 0 or stat(path.c_str(),&st) != 0) {
+        return;
+    }
+
+    if (current.st_ino == st.st_ino and current.st_dev == st.st_dev) {
+        return;
+    }
+
+    const char* options = (read_only) ? "r" : "r+";
+    FILE* fresh = fopen(path.c_str(),options);
+
+    if (fresh == nullptr) {
+        stringstream ss;
+        ss<<"Failed to reopen FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    unmap();
+    fclose(db);
+    db = fresh;
+
+    // writer may have switched format
+    guess_format();
+    fseek(db,0,SEEK_SET);
+}
+
+void FileDB::append(const string& buffer, bool sync)
+{
+    struct stat st;
+    fstat(fileno(db),&st);
+
+    int fd = ::open(journal_path.c_str(),O_RDWR | O_CREAT | O_APPEND,st.st_mode & 07777);
+
+    if (fd < 0) {
+        stringstream ss;
+        ss<<"Failed to open FileDB journal:"<<journal_path;
+        throw runtime_error(ss.str());
+    }
+
+    struct stat jst;
+    fstat(fd,&jst);
+    size_t size = jst.st_size;
+    string base = base_id();
+    bool stale = false;
+
+    string valid;
+
+    // whatever a crashed writer left half written has to go
+    if (size > 0) {
+        void* ptr = mmap(nullptr,size,PROT_READ,MAP_SHARED,fd,0);
+
+        if (ptr != MAP_FAILED) {
+            size_t end = journal_end((const char*)ptr,size);
+            journal_start((const char*)ptr,end,base,stale);
+
+            if (!stale and end != size) {
+                valid = string((const char*)ptr,end);
+
+                // nothing complete in it, same as a journal to drop
+                stale = (end == 0);
+            }
+
+            munmap(ptr,size);
+        }
+    }
+
+    /*
+        lock-free readers may have journal mapped and would fault on
+        truncated pages, so complete records go to a fresh file renamed
+        over it instead of shrinking it
+    */
+    if (valid.size() > 0) {
+        ::close(fd);
+
+        string tmp_path = write_temp(journal_path,valid,durability != Durability::None);
+
+        if (rename(tmp_path.c_str(),journal_path.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+
+            stringstream ss;
+            ss<<"Failed to repair FileDB journal:"<<journal_path;
+            throw runtime_error(ss.str());
+        }
+
+        fd = ::open(journal_path.c_str(),O_RDWR | O_APPEND);
+
+        if (fd < 0) {
+            stringstream ss;
+            ss<<"Failed to open FileDB journal:"<<journal_path;
+            throw runtime_error(ss.str());
+        }
+
+        size = valid.size();
+    }
+
+    /*
+        left behind by a fold that crashed before removing it, its updates
+        are already in base file
+    */
+    if (stale) {
+        ::close(fd);
+        unlink(journal_path.c_str());
+
+        fd = ::open(journal_path.c_str(),O_RDWR | O_CREAT | O_APPEND,st.st_mode & 07777);
+
+        if (fd < 0) {
+            stringstream ss;
+            ss<<"Failed to open FileDB journal:"<<journal_path;
+            throw runtime_error(ss.str());
+        }
+
+        size = 0;
+    }
+
+    string data;
+
+    if (size == 0) {
+        Variant marker = Variant::create_struct();
+        marker["op"] = "base";
+        marker["base"] = base;
+
+        stringstream ss(std::stringstream::out | std::stringstream::binary);
+        bson::dump(marker,ss);
+        data = ss.str();
+    }
+
+    data += buffer;
+
+    const char* ptr = data.c_str();
+    size_t remain = data.size();
+
+    while (remain > 0) {
+        ssize_t len = ::write(fd,ptr,remain);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ::close(fd);
+
+            stringstream ss;
+            ss<<"Failed to append FileDB journal:"<<journal_path;
+            throw runtime_error(ss.str());
+        }
+
+        ptr += len;
+        remain -= len;
+    }
+
+    if (durability != Durability::None and sync) {
+        fdatasync(fd);
+    }
+
+    ::close(fd);
+
+    if (size == 0) {
+        // journal has just been created
+        journal_created = true;
+    }
+
+    if (sync and journal_created) {
+        if (durability == Durability::Full) {
+            sync_dir();
+        }
+
+        journal_created = false;
+    }
+}
+
+void FileDB::sync()
+{
+    if (durability == Durability::None) {
+        return;
+    }
+
+    int fd = ::open(journal_path.c_str(),O_RDONLY);
+
+    if (fd >= 0) {
+        fdatasync(fd);
+        ::close(fd);
+    }
+
+    // a missing journal was folded by a compaction, already synced
+
+    if (journal_created) {
+        if (durability == Durability::Full) {
+            sync_dir();
+        }
+
+        journal_created = false;
+    }
+}
+
+void FileDB::sync_dir()
+{
+    sync_parent(path);
+}
+
+string FileDB::base_id()
+{
+    struct stat st;
+
+    if (fstat(fileno(db),&st) != 0) {
+        stringstream ss;
+        ss<<"Failed to stat FileDB:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    return std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+}
+
+/*
+    Value of a field as index key, empty if it can not be compared
+*/
+static string field_token(Variant value)
+{
+    if (value.is_int32()) {
+        return "i" + std::to_string(value.get_int32());
+    }
+
+    if (value.is_string()) {
+        return "s" + value.get_string();
+    }
+
+    return "";
+}
+
+/*
+    Collection being replayed. Records are held in a vector with lazily
+    built indexes by field value, so each journal entry is applied in
+    place and the array is only rebuilt once at the end. Index entries
+    are never removed, positions are checked again when used
+*/
+class ReplayCollection
+{
+    public:
+
+    ReplayCollection(Variant items)
+    {
+        for (size_t n=0;n<items.count();n++) {
+            records.push_back(items[n]);
+            alive.push_back(true);
+        }
+    }
+
+    void upsert(const string& field, const string& key, Variant value, Variant unique)
+    {
+        string key_token = "s" + key;
+
+        // any other record sharing a unique field is dropped
+        if (unique.is_array()) {
+            for (size_t n=0;n<unique.count();n++) {
+                string name = unique[n].get_string();
+                string token = field_token(value[name]);
+
+                if (token.size() == 0) {
+                    continue;
+                }
+
+                for (size_t pos : lookup(name,token)) {
+                    if (field_token(records[pos][field]) != key_token) {
+                        alive[pos] = false;
+                    }
+                }
+            }
+        }
+
+        bool found = false;
+        size_t target = 0;
+
+        for (size_t pos : lookup(field,key_token)) {
+            if (found and pos == target) {
+                continue;
+            }
+
+            if (found) {
+                // duplicated key, only first record is kept
+                alive[pos] = false;
+            }
+            else {
+                records[pos] = value;
+                target = pos;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            target = records.size();
+            records.push_back(value);
+            alive.push_back(true);
+        }
+
+        for (auto& index : indexes) {
+            string token = field_token(value[index.first]);
+
+            if (token.size() > 0) {
+                index.second[token].push_back(target);
+            }
+        }
+    }
+
+    void remove(const string& field, const string& key)
+    {
+        for (size_t pos : lookup(field,"s" + key)) {
+            alive[pos] = false;
+        }
+    }
+
+    Variant to_array()
+    {
+        Variant items = Variant::create_array(0);
+
+        for (size_t n=0;n<records.size();n++) {
+            if (alive[n]) {
+                items.append(records[n]);
+            }
+        }
+
+        return items;
+    }
+
+    protected:
+
+    /*
+        live positions whose field currently holds token
+    */
+    vector<size_t> lookup(const string& name, const string& token)
+    {
+        auto index = indexes.find(name);
+
+        if (index == indexes.end()) {
+            index = indexes.emplace(name,unordered_map<string,vector<size_t>>()).first;
+
+            for (size_t n=0;n<records.size();n++) {
+                string current = field_token(records[n][name]);
+
+                if (alive[n] and current.size() > 0) {
+                    index->second[current].push_back(n);
+                }
+            }
+        }
+
+        vector<size_t> positions;
+        auto entry = index->second.find(token);
+
+        if (entry == index->second.end()) {
+            return positions;
+        }
+
+        for (size_t pos : entry->second) {
+            if (alive[pos] and field_token(records[pos][name]) == token) {
+                positions.push_back(pos);
+            }
+        }
+
+        return positions;
+    }
+
+    vector<Variant> records;
+    vector<bool> alive;
+    unordered_map<string,unordered_map<string,vector<size_t>>> indexes;
+};
+
+void FileDB::replay(Variant data)
+{
+    unordered_map<string,ReplayCollection> collections;
+
+    scan_journal([&](BsonView record) {
+        string_view op = record["op"].get_string();
+        string collection(record["collection"].get_string());
+        string field(record["field"].get_string());
+        string key(record["key"].get_string());
+
+        auto it = collections.find(collection);
+
+        if (it == collections.end()) {
+            Variant items = data[collection];
+
+            if (!items.is_array()) {
+                items = Variant::create_array(0);
+            }
+
+            it = collections.emplace(collection,ReplayCollection(items)).first;
+        }
+
+        if (op == "upsert") {
+            it->second.upsert(field,key,record["value"].to_variant(),record["unique"].to_variant());
+        }
+        else {
+            it->second.remove(field,key);
+        }
+    });
+
+    for (auto& it : collections) {
+        data[it.first] = it.second.to_array();
+    }
+}
+
+void FileDB::scan_journal(function<void(BsonView)> callback)
+{
+    int fd = ::open(journal_path.c_str(),O_RDONLY);
+
+    if (fd < 0) {
+        // no journal, nothing to do
+        return;
+    }
+
+    struct stat st;
+    fstat(fd,&st);
+
+    if (st.st_size == 0) {
+        ::close(fd);
+        return;
+    }
+
+    void* ptr = mmap(nullptr,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+
+    if (ptr == MAP_FAILED) {
+        stringstream ss;
+        ss<<"Failed to map FileDB journal:"<<journal_path;
+        throw runtime_error(ss.str());
+    }
+
+    const char* journal = (const char*)ptr;
+    size_t end = journal_end(journal,st.st_size);
+    bool stale;
+    size_t offset = journal_start(journal,end,base_id(),stale);
+
+    if (stale) {
+        munmap(ptr,st.st_size);
+        return;
+    }
+
+    try {
+        while (offset < end) {
+            int32_t len;
+            std::memcpy(&len,journal + offset,4);
+
+            BsonView record(journal + offset,len);
+            offset += len;
+
+            callback(record);
+        }
+    }
+    catch (std::exception& e) {
+        munmap(ptr,st.st_size);
+        throw;
     }
 
+    munmap(ptr,st.st_size);
 }
@@ -5,24 +5,148 @@
 #ifndef LLX_GVA_GATE_FILEDB
 #define LLX_GVA_GATE_FILEDB
 
+#include "bsonview.hpp"
+
 #include <variant.hpp>
+
+#include <sys/types.h>
+#include <time.h>
+
 #include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <stdexcept>
 #include <string>
+#include <streambuf>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+/* journal size that triggers a compaction, in bytes */
+#define LLX_GVA_GATE_JOURNAL_LIMIT 64 * 1024
+
+/* lock-free read attempts before falling back to a shared lock */
+#define LLX_GVA_GATE_SNAPSHOT_RETRIES 64
+
+/* default deadline for lock acquisition, in milliseconds */
+#define LLX_GVA_GATE_LOCK_TIMEOUT 10000
+
+/* optimistic rewrites losing against other writers before taking the lock upfront */
+#define LLX_GVA_GATE_REWRITE_RETRIES 8
 
 namespace lliurex
 {
     enum class DBFormat
     {
         Json,
-        Bson
+        Bson,
+        Indexed
+    };
+
+    enum class Durability
+    {
+        /* fsync database file and its directory */
+        Full,
+        /* fsync database file only */
+        File,
+        /* leave it to the kernel */
+        None
     };
 
     enum class LockMode
     {
         Read,
+        /* kernel shared lock, always taken so writers are kept out */
+        Shared,
         Write
     };
 
+    namespace exception
+    {
+        class LockTimeout: public std::runtime_error
+        {
+            public:
+
+            LockTimeout(std::string message) : std::runtime_error(message)
+            {
+            }
+        };
+    }
+
+    /*
+        Contents of <db>.lock, shared by every process using database.
+        Counters are only updated by processes that can write lock file
+    */
+    struct LockHeader
+    {
+        /* seqlock, odd while a commit swaps database file and journal */
+        uint64_t generation;
+
+        uint64_t locks;
+        uint64_t timeouts;
+        uint64_t wait_us;
+        uint64_t max_wait_us;
+        uint64_t hold_us;
+        uint64_t max_hold_us;
+    };
+
+    /*!
+        Identity of base file and journal, as stat reports them. Two keys
+        only match when base file could be stat'ed on both
+    */
+    struct SnapshotKey
+    {
+        bool valid = false;
+
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtim;
+
+        bool journal;
+        ino_t journal_ino;
+        off_t journal_size;
+        struct timespec journal_mtim;
+
+        bool operator==(const SnapshotKey& other) const
+        {
+            if (!valid or !other.valid) {
+                return false;
+            }
+
+            if (dev != other.dev or ino != other.ino or size != other.size or
+                mtim.tv_sec != other.mtim.tv_sec or mtim.tv_nsec != other.mtim.tv_nsec or
+                journal != other.journal) {
+                return false;
+            }
+
+            return !journal or (journal_ino == other.journal_ino and journal_size == other.journal_size and
+                journal_mtim.tv_sec == other.journal_mtim.tv_sec and
+                journal_mtim.tv_nsec == other.journal_mtim.tv_nsec);
+        }
+
+        bool operator!=(const SnapshotKey& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    /*!
+        Read-only stream buffer over a memory region, used to decode
+        straight from a mapped file without copying it first
+    */
+    class MemoryBuffer : public std::streambuf
+    {
+        public:
+
+        MemoryBuffer(const char* data, size_t size)
+        {
+            char* ptr = const_cast<char*>(data);
+            setg(ptr, ptr, ptr + size);
+        }
+    };
+
     class FileDB
     {
         public:
@@ -34,27 +158,291 @@ namespace lliurex
         bool exists();
         bool is_open();
 
+        /*!
+            Keeps handle open after AutoLock goes out of scope, so it can
+            be reused by next call. A file replaced by a writer is picked
+            up again when locking
+        */
+        void set_keep_open(bool keep_open)
+        {
+            this->keep_open = keep_open;
+        }
+
+        bool get_keep_open()
+        {
+            return keep_open;
+        }
+
         void create(DBFormat format, uint32_t mode = 775);
         bool open(bool read_only = false);
         void close();
 
+        /*!
+            When lock file carries a generation header, readers take no
+            kernel lock at all. read() and find() validate generation
+            around the snapshot they used and retry if a commit raced them
+        */
         void lock_read();
+
+        /*!
+            Shared kernel lock, even with a generation header. For those
+            that must not overlap a writer, not only read consistently
+        */
+        void lock_shared();
+
         void lock_write();
         void unlock();
 
+        /*!
+            Locking gives up after timeout milliseconds throwing
+            exception::LockTimeout, zero waits forever
+        */
+        void set_lock_timeout(int32_t timeout)
+        {
+            this->lock_timeout = timeout;
+        }
+
+        /*!
+            Lock counters stored in lock file, times in microseconds
+        */
+        edupals::variant::Variant lock_stats();
+
+        /*!
+            Microseconds last kernel lock taken by this handle was held
+        */
+        uint64_t last_hold()
+        {
+            return hold_us;
+        }
+
+        void set_durability(Durability durability)
+        {
+            this->durability = durability;
+        }
+
+        DBFormat get_format()
+        {
+            return format;
+        }
+
+        /*!
+            Format used on next write
+        */
+        void set_format(DBFormat format)
+        {
+            this->format = format;
+        }
+
+        void set_journal_limit(size_t limit)
+        {
+            this->journal_limit = limit;
+        }
+
+        /*!
+            Durable location for a database that lives in tmpfs, it is
+            refreshed by persist() and copied back by restore()
+        */
+        void set_backing(std::string path)
+        {
+            this->backing_path = path;
+        }
+
+        std::string get_backing()
+        {
+            return backing_path;
+        }
+
+        /*!
+            Writes current data, journal folded in, to backing file. Data
+            is taken as a snapshot like read() does, so a read lock is
+            enough and writers are not held back
+        */
+        void persist();
+
+        /*!
+            Replaces database with backing file, returns false if there
+            is nothing to restore from. Database must not be open
+        */
+        bool restore();
+
         edupals::variant::Variant read();
+
+        /*!
+            Also returns checksum of base snapshot the data was built
+            from, stored at write time. Empty for Indexed format and for
+            files written by older versions
+        */
+        edupals::variant::Variant read(std::string& checksum);
+
+        /*!
+            Same as read(), but parsed data is kept and handed out again
+            while base file and journal are unchanged. Returned data is
+            shared between calls and must not be modified
+        */
+        edupals::variant::Variant read_shared(std::string& checksum);
+
         void write(edupals::variant::Variant data);
 
+        /*!
+            Replaces whole database with what update builds from current
+            one. Reading, update and serialization run without lock, write
+            lock is only held to check nothing was committed meanwhile and
+            swap files. Lost races are retried, and after a few attempts
+            it is done under lock. No lock must be held by caller
+        */
+        void rewrite(std::function<edupals::variant::Variant(edupals::variant::Variant)> update);
+
+        /*!
+            Journaled updates over an array of structs inside database,
+            collection is the array name and field the struct key. Any
+            other struct sharing one of the unique fields with value is
+            dropped on upsert.
+
+            Updates are queued without taking database lock and made
+            durable by commit(), so concurrent writers can be batched
+        */
+        std::string queue_upsert(std::string collection, std::string field, std::string key,
+                                 edupals::variant::Variant value, std::vector<std::string> unique = {});
+        std::string queue_remove(std::string collection, std::string field, std::string key);
+
+        /*!
+            Moves every queued update to journal with a single sync if
+            ticket is still pending. A write lock is expected. Returns how
+            many updates were committed, zero means another writer
+            already committed our ticket. Journal is not folded here, see
+            compact_if_due().
+
+            With sync false journal is not flushed, caller must call
+            sync() before releasing its lock.
+
+            Queue lock is released while the batch is appended, queuers
+            never wait for disk. Batch only leaves queue once it is in
+            journal, a commit that fails or dies leaves it to next one
+        */
+        size_t commit(std::string ticket, bool sync = true);
+
+        /*!
+            Flushes journal appended by commit(ticket,false)
+        */
+        void sync();
+
+        /*!
+            queue and commit at once, a write lock is expected
+        */
+        void upsert(std::string collection, std::string field, std::string key,
+                    edupals::variant::Variant value, std::vector<std::string> unique = {});
+        void remove(std::string collection, std::string field, std::string key);
+
+        /*!
+            Point lookup of a struct inside collection array, taking
+            journal into account. Returns false if not found.
+
+            A snapshot already parsed by read_shared(), or looked up a
+            second time, is answered from in-memory hash indexes built
+            over it until base file or journal change. Found record may
+            then be shared and must not be modified
+        */
+        bool find(const std::string& collection, const std::string& field, const std::string& key,
+                  edupals::variant::Variant& out);
+
+        /*!
+            Folds journal into database file, a write lock is expected
+        */
+        void compact();
+
+        /*!
+            Folds journal once it grows past its limit, without holding
+            any lock but for the file swap. Nothing is done if another
+            writer commits meanwhile, it is tried again next time. Returns
+            whether journal was folded
+        */
+        bool compact_if_due();
 
         protected:
 
         void guess_format();
 
+        std::string encode(edupals::variant::Variant data);
+        std::string write_temp(std::string target, const std::string& buffer, bool sync);
+        void swap_in(std::string tmp_path);
+        bool try_rewrite(std::function<edupals::variant::Variant(edupals::variant::Variant)> update);
+
+        void map();
+        void unmap();
+
+        void open_lock(bool read_only);
+        void reopen();
+
+        void acquire(int operation);
+        void release();
+
+        void map_header(bool read_only);
+        void unmap_header();
+        void begin_commit();
+        void end_commit();
+        void consistent(std::function<void()> body);
+
+        SnapshotKey snapshot_key();
+
+        /*!
+            Identity of base file a journal marker refers to
+        */
+        std::string base_id();
+        void load_shared(const SnapshotKey& key);
+        bool find_shared(const std::string& collection, const std::string& field, const std::string& key,
+                         edupals::variant::Variant& out);
+
+        edupals::variant::Variant load();
+        edupals::variant::Variant load(std::string& checksum);
+        bool lookup(const std::string& collection, const std::string& field, const std::string& key,
+                    edupals::variant::Variant& out);
+        bool find_base(const std::string& collection, const std::string& field, const std::string& key,
+                       edupals::variant::Variant& out);
+
+        std::string queue(edupals::variant::Variant record);
+        void lock_queue(int fd);
+        void dequeue(size_t size);
+        void append(const std::string& buffer, bool sync);
+        void sync_dir();
+        void replay(edupals::variant::Variant data);
+        void scan_journal(std::function<void(BsonView)> callback);
+
         DBFormat format;
+        Durability durability;
         std::string path;
         FILE* db;
+        int lock_fd;
+        bool read_only;
         std::string magic;
 
+        const char* map_data;
+        size_t map_size;
+
+        LockHeader* header;
+        bool snapshot;
+
+        int32_t lock_timeout;
+        std::chrono::steady_clock::time_point locked_at;
+        uint64_t hold_us;
+
+        std::string journal_path;
+        std::string pending_path;
+        std::string backing_path;
+        size_t journal_limit;
+        bool journal_created;
+        bool keep_open;
+
+        edupals::variant::Variant shared_data;
+        SnapshotKey shared_key;
+        std::string shared_checksum;
+
+        /* collection, field and key to position in shared_data */
+        std::unordered_map<std::string,
+            std::unordered_map<std::string,std::unordered_map<std::string,size_t>>> shared_index;
+
+        /* snapshot of last lookup not served from shared_data */
+        SnapshotKey probed_key;
+
     };
 
     class AutoLock
@@ -68,6 +456,11 @@ namespace lliurex
                         target->open(true);
                         target->lock_read();
 
+                        break;
+                    case LockMode::Shared:
+                        target->open(true);
+                        target->lock_shared();
+
                         break;
                     case LockMode::Write:
                         target->open();
@@ -80,7 +473,10 @@ namespace lliurex
             ~AutoLock()
             {
                 unlock();
-                target->close();
+
+                if (!target->get_keep_open()) {
+                    target->close();
+                }
             }
 
             void unlock()
@@ -0,0 +1,159 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "filestorage.hpp"
+#include "filedb.hpp"
+
+#include <variant.hpp>
+
+#include <memory>
+#include <stdexcept>
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+
+FileStorage::FileStorage() : db(nullptr), held(false)
+{
+}
+
+FileStorage::FileStorage(FileDB* db, string collection, string field, vector<string> unique) : db(db),
+    collection(collection), field(field), unique(unique), held(false)
+{
+}
+
+bool FileStorage::exists()
+{
+    return db->exists();
+}
+
+void FileStorage::create(uint32_t mode)
+{
+    db->create(DBFormat::Bson,mode);
+
+    Variant data = Variant::create_struct();
+    data[collection] = Variant::create_array(0);
+
+    db->open();
+
+    db->lock_write();
+    db->write(data);
+    db->unlock();
+    db->close();
+}
+
+Variant FileStorage::lock_stats()
+{
+    db->open(true);
+    Variant stats = db->lock_stats();
+    db->close();
+
+    return stats;
+}
+
+Variant FileStorage::read()
+{
+    auto lock = this->lock(LockMode::Read);
+
+    return db->read();
+}
+
+void FileStorage::write(Variant data)
+{
+    if (held) {
+        db->write(data);
+        return;
+    }
+
+    // serialization runs without lock, only swap is done under it
+    db->rewrite([&](Variant) {
+        return data;
+    });
+}
+
+void FileStorage::each(function<bool(Variant)> callback)
+{
+    Variant records = read()[collection];
+
+    for (size_t n=0;n<records.count();n++) {
+        if (!callback(records[n])) {
+            break;
+        }
+    }
+}
+
+bool FileStorage::find(const string& key, Variant& out)
+{
+    auto lock = this->lock(LockMode::Read);
+
+    return db->find(collection,field,key,out);
+}
+
+void FileStorage::upsert(const string& key, Variant value)
+{
+    commit(db->queue_upsert(collection,field,key,value,unique));
+}
+
+void FileStorage::remove(const string& key)
+{
+    commit(db->queue_remove(collection,field,key));
+}
+
+void FileStorage::transaction(function<void()> body)
+{
+    if (held) {
+        body();
+        return;
+    }
+
+    AutoLock lock(LockMode::Write,db);
+    held = true;
+
+    try {
+        body();
+    }
+    catch (std::exception& e) {
+        held = false;
+        throw;
+    }
+
+    held = false;
+}
+
+void FileStorage::compact()
+{
+    if (held) {
+        db->compact();
+        return;
+    }
+
+    // rewriting folds journal too
+    db->rewrite([](Variant current) {
+        return current;
+    });
+}
+
+unique_ptr<AutoLock> FileStorage::lock(LockMode mode)
+{
+    if (held) {
+        return nullptr;
+    }
+
+    return unique_ptr<AutoLock>(new AutoLock(mode,db));
+}
+
+void FileStorage::commit(const string& ticket)
+{
+    {
+        // lock only covers moving queue to journal
+        auto lock = this->lock(LockMode::Write);
+        db->commit(ticket);
+    }
+
+    if (!held) {
+        db->compact_if_due();
+    }
+}
@@ -0,0 +1,97 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_FILESTORAGE
+#define LLX_GVA_GATE_FILESTORAGE
+
+#include "filedb.hpp"
+#include "storage.hpp"
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lliurex
+{
+    /*!
+        Storage over a collection of a FileDB, so a journaled file is used
+        the same way record backends are. FileDB is not owned, whoever
+        owns it still handles its backing copy.
+
+        Upserts are queued before taking write lock, so concurrent writers
+        share a single journal sync.
+    */
+    class FileStorage : public Storage
+    {
+        public:
+
+        FileStorage();
+
+        /*!
+            unique fields are passed on to FileDB, an upsert drops any
+            other record sharing one of them
+        */
+        FileStorage(FileDB* db, std::string collection, std::string field,
+                    std::vector<std::string> unique = {});
+
+        bool exists();
+
+        /*!
+            Creates database holding an empty collection
+        */
+        void create(uint32_t mode);
+
+        void set_durability(Durability durability)
+        {
+            db->set_durability(durability);
+        }
+
+        void set_lock_timeout(int32_t timeout)
+        {
+            db->set_lock_timeout(timeout);
+        }
+
+        edupals::variant::Variant lock_stats();
+
+        edupals::variant::Variant read();
+        void write(edupals::variant::Variant data);
+        void each(std::function<bool(edupals::variant::Variant)> callback);
+
+        bool find(const std::string& key, edupals::variant::Variant& out);
+
+        void upsert(const std::string& key, edupals::variant::Variant value);
+        void remove(const std::string& key);
+
+        /*!
+            Holds write lock while body runs
+        */
+        void transaction(std::function<void()> body);
+
+        /*!
+            Folds journal into database file
+        */
+        void compact();
+
+        protected:
+
+        /*!
+            Locks database, unless a transaction already holds it
+        */
+        std::unique_ptr<AutoLock> lock(LockMode mode);
+
+        void commit(const std::string& ticket);
+
+        FileDB* db;
+        std::string collection;
+        std::string field;
+        std::vector<std::string> unique;
+        bool held;
+    };
+}
+
+#endif
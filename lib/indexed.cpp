@@ -0,0 +1,474 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "indexed.hpp"
+
+#include <variant.hpp>
+
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+
+using namespace lliurex;
+using namespace lliurex::indexed;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+
+static uint32_t hash_string(const char* str, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (size_t n=0;n<len;n++) {
+        hash ^= (uint8_t)str[n];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t hash_int(int32_t value)
+{
+    return (uint32_t)value * 2654435761u;
+}
+
+static uint32_t table_size(uint32_t count)
+{
+    uint32_t size = 2;
+
+    while (size < count * 2) {
+        size = size << 1;
+    }
+
+    return size;
+}
+
+static void table_insert(vector<Slot>& table, uint32_t hash, uint32_t key, uint32_t index)
+{
+    uint32_t mask = table.size() - 1;
+    uint32_t pos = hash & mask;
+
+    while (table[pos].index != 0) {
+        pos = (pos + 1) & mask;
+    }
+
+    table[pos].key = key;
+    table[pos].index = index + 1;
+}
+
+static uint32_t align(uint32_t offset)
+{
+    return (offset + 3) & ~3u;
+}
+
+class Pool
+{
+    public:
+
+    uint32_t push(const string& str)
+    {
+        auto it = offsets.find(str);
+
+        if (it != offsets.end()) {
+            return it->second;
+        }
+
+        uint32_t offset = data.size();
+        data.append(str);
+        data.push_back(0);
+        offsets[str] = offset;
+
+        return offset;
+    }
+
+    string data;
+
+    protected:
+
+    unordered_map<string,uint32_t> offsets;
+};
+
+static void expect(bool condition, const char* what)
+{
+    if (!condition) {
+        throw runtime_error(string("Indexed database: ") + what);
+    }
+}
+
+bool indexed::is_indexed(const char* data, size_t size)
+{
+    uint32_t signature;
+
+    if (size < sizeof(Header)) {
+        return false;
+    }
+
+    std::memcpy(&signature,data,4);
+
+    return (signature == Signature);
+}
+
+void indexed::dump(string magic, Variant data, ostream& stream)
+{
+    expect(data.is_struct(),"Expected struct");
+    expect(data["users"].is_array(),"Expected users array");
+
+    Variant users = data["users"];
+
+    Pool pool;
+    vector<User> user_records;
+    vector<Group> group_records;
+    vector<uint32_t> members;
+    map<pair<string,int32_t>,uint32_t> group_index;
+
+    auto push_group = [&](Variant group) -> uint32_t {
+        expect(group.is_struct(),"Expected group struct");
+        expect(group["name"].is_string(),"Expected field name with type String");
+        expect(group["gid"].is_int32(),"Expected field gid with type Int32");
+
+        pair<string,int32_t> key(group["name"].get_string(),group["gid"].get_int32());
+        auto it = group_index.find(key);
+
+        if (it != group_index.end()) {
+            return it->second;
+        }
+
+        Group record;
+        record.name = pool.push(key.first);
+        record.gid = key.second;
+
+        uint32_t index = group_records.size();
+        group_records.push_back(record);
+        group_index[key] = index;
+
+        return index;
+    };
+
+    /*
+        normalized databases carry a group table and users refer to it by
+        gid, older ones embed group structs on every user
+    */
+    unordered_map<int32_t,uint32_t> by_gid;
+    Variant table = data["groups"];
+
+    if (table.is_array()) {
+        for (size_t n=0;n<table.count();n++) {
+            uint32_t index = push_group(table[n]);
+            by_gid.emplace(table[n]["gid"].get_int32(),index);
+        }
+    }
+
+    auto push_ref = [&](Variant ref) -> int64_t {
+        if (ref.is_struct()) {
+            return push_group(ref);
+        }
+
+        expect(ref.is_int32(),"Expected group reference with type Int32");
+
+        auto it = by_gid.find(ref.get_int32());
+
+        if (it == by_gid.end()) {
+            return -1;
+        }
+
+        return it->second;
+    };
+
+    auto push_string = [&](Variant value, const char* what) -> uint32_t {
+        expect(value.is_string(),what);
+        return pool.push(value.get_string());
+    };
+
+    for (size_t n=0;n<users.count();n++) {
+        Variant user = users[n];
+        User record;
+
+        expect(user.is_struct(),"Expected user struct");
+        expect(user["uid"].is_int32(),"Expected field uid with type Int32");
+        expect(user["groups"].is_array(),"Expected field groups with type Array");
+
+        record.login = push_string(user["login"],"Expected field login with type String");
+        record.uid = user["uid"].get_int32();
+
+        int64_t gid = push_ref(user["gid"]);
+
+        // a primary group missing from table is still a valid passwd gid
+        if (gid < 0) {
+            Variant group = Variant::create_struct();
+            group["name"] = std::to_string(user["gid"].get_int32());
+            group["gid"] = user["gid"];
+
+            gid = push_group(group);
+            by_gid.emplace(user["gid"].get_int32(),gid);
+        }
+
+        record.gid = gid;
+        record.name = push_string(user["name"],"Expected field name with type String");
+        record.surname = push_string(user["surname"],"Expected field surname with type String");
+        record.home = push_string(user["home"],"Expected field home with type String");
+        record.shell = push_string(user["shell"],"Expected field shell with type String");
+        record.method = Null;
+
+        if (user["method"].is_string()) {
+            record.method = pool.push(user["method"].get_string());
+        }
+
+        Variant groups = user["groups"];
+        record.groups = members.size();
+
+        for (size_t m=0;m<groups.count();m++) {
+            int64_t index = push_ref(groups[m]);
+
+            if (index >= 0) {
+                members.push_back(index);
+            }
+        }
+
+        record.group_count = members.size() - record.groups;
+
+        user_records.push_back(record);
+    }
+
+    Header header;
+    std::memset(&header,0,sizeof(header));
+
+    header.signature = Signature;
+    header.version = Version;
+    header.magic = pool.push(magic);
+    header.user_count = user_records.size();
+    header.group_count = group_records.size();
+    header.user_slots = table_size(header.user_count);
+    header.group_slots = table_size(header.group_count);
+    header.member_count = members.size();
+
+    header.users = align(sizeof(Header));
+    header.groups = header.users + sizeof(User) * header.user_count;
+    header.members = header.groups + sizeof(Group) * header.group_count;
+    header.login_table = header.members + sizeof(uint32_t) * header.member_count;
+    header.uid_table = header.login_table + sizeof(Slot) * header.user_slots;
+    header.gid_table = header.uid_table + sizeof(Slot) * header.user_slots;
+    header.strings = header.gid_table + sizeof(Slot) * header.group_slots;
+    header.strings_size = pool.data.size();
+
+    vector<Slot> login_table(header.user_slots,{0,0});
+    vector<Slot> uid_table(header.user_slots,{0,0});
+    vector<Slot> gid_table(header.group_slots,{0,0});
+
+    for (uint32_t n=0;n<header.user_count;n++) {
+        const char* login = pool.data.c_str() + user_records[n].login;
+        uint32_t hash = hash_string(login,std::strlen(login));
+        int32_t uid = user_records[n].uid;
+
+        table_insert(login_table,hash,hash,n);
+        table_insert(uid_table,hash_int(uid),(uint32_t)uid,n);
+    }
+
+    for (uint32_t n=0;n<header.group_count;n++) {
+        int32_t gid = group_records[n].gid;
+
+        table_insert(gid_table,hash_int(gid),(uint32_t)gid,n);
+    }
+
+    stream.write((const char*)&header,sizeof(Header));
+    stream.write((const char*)user_records.data(),sizeof(User) * user_records.size());
+    stream.write((const char*)group_records.data(),sizeof(Group) * group_records.size());
+    stream.write((const char*)members.data(),sizeof(uint32_t) * members.size());
+    stream.write((const char*)login_table.data(),sizeof(Slot) * login_table.size());
+    stream.write((const char*)uid_table.data(),sizeof(Slot) * uid_table.size());
+    stream.write((const char*)gid_table.data(),sizeof(Slot) * gid_table.size());
+    stream.write(pool.data.c_str(),pool.data.size());
+}
+
+Reader::Reader(const char* data, size_t size) : data(data), size(size)
+{
+    expect(is_indexed(data,size),"Bad signature");
+
+    header = (const Header*)data;
+
+    expect(header->version == Version,"Unsupported version");
+
+    uint64_t users_end = (uint64_t)header->users + (uint64_t)sizeof(User) * header->user_count;
+    uint64_t groups_end = (uint64_t)header->groups + (uint64_t)sizeof(Group) * header->group_count;
+    uint64_t members_end = (uint64_t)header->members + (uint64_t)sizeof(uint32_t) * header->member_count;
+    uint64_t login_end = (uint64_t)header->login_table + (uint64_t)sizeof(Slot) * header->user_slots;
+    uint64_t uid_end = (uint64_t)header->uid_table + (uint64_t)sizeof(Slot) * header->user_slots;
+    uint64_t gid_end = (uint64_t)header->gid_table + (uint64_t)sizeof(Slot) * header->group_slots;
+    uint64_t strings_end = (uint64_t)header->strings + header->strings_size;
+
+    expect(users_end <= size and groups_end <= size and members_end <= size,"Truncated records");
+    expect(login_end <= size and uid_end <= size and gid_end <= size,"Truncated tables");
+    expect(strings_end <= size,"Truncated string pool");
+
+    // tables rely on power of two sizes
+    expect(header->user_slots > 0 and (header->user_slots & (header->user_slots - 1)) == 0,"Bad table size");
+    expect(header->group_slots > 0 and (header->group_slots & (header->group_slots - 1)) == 0,"Bad table size");
+    expect(header->user_slots > header->user_count and header->group_slots > header->group_count,"Bad table size");
+}
+
+const char* Reader::str(uint32_t offset) const
+{
+    expect(offset < header->strings_size,"Bad string offset");
+
+    const char* str = data + header->strings + offset;
+    expect(std::memchr(str,0,header->strings_size - offset) != nullptr,"Unterminated string");
+
+    return str;
+}
+
+const User* Reader::user_record(uint32_t index) const
+{
+    expect(index < header->user_count,"Bad user index");
+
+    return (const User*)(data + header->users) + index;
+}
+
+std::string Reader::magic() const
+{
+    return std::string(str(header->magic));
+}
+
+Variant Reader::group(uint32_t index) const
+{
+    expect(index < header->group_count,"Bad group index");
+
+    const Group* record = (const Group*)(data + header->groups) + index;
+
+    Variant group = Variant::create_struct();
+    group["name"] = std::string(str(record->name));
+    group["gid"] = record->gid;
+
+    return group;
+}
+
+Variant Reader::user(uint32_t index) const
+{
+    const User* record = user_record(index);
+
+    Variant user = Variant::create_struct();
+    user["login"] = std::string(str(record->login));
+    user["uid"] = record->uid;
+    user["gid"] = group(record->gid)["gid"];
+    user["name"] = std::string(str(record->name));
+    user["surname"] = std::string(str(record->surname));
+    user["home"] = std::string(str(record->home));
+    user["shell"] = std::string(str(record->shell));
+
+    expect((uint64_t)record->groups + record->group_count <= header->member_count,"Bad group list");
+
+    const uint32_t* members = (const uint32_t*)(data + header->members) + record->groups;
+    Variant groups = Variant::create_array(0);
+
+    for (uint32_t n=0;n<record->group_count;n++) {
+        groups.append(group(members[n])["gid"]);
+    }
+
+    user["groups"] = groups;
+
+    if (record->method != Null) {
+        user["method"] = std::string(str(record->method));
+    }
+
+    return user;
+}
+
+Variant Reader::load() const
+{
+    Variant database = Variant::create_struct();
+    Variant users = Variant::create_array(0);
+
+    for (uint32_t n=0;n<header->user_count;n++) {
+        users.append(user(n));
+    }
+
+    database["users"] = users;
+
+    Variant groups = Variant::create_array(0);
+
+    for (uint32_t n=0;n<header->group_count;n++) {
+        groups.append(group(n));
+    }
+
+    database["groups"] = groups;
+
+    return database;
+}
+
+int64_t Reader::find_login(const std::string& login) const
+{
+    const Slot* table = (const Slot*)(data + header->login_table);
+    uint32_t mask = header->user_slots - 1;
+    uint32_t hash = hash_string(login.c_str(),login.size());
+    uint32_t pos = hash & mask;
+
+    for (uint32_t probe=0;probe<header->user_slots and table[pos].index != 0;probe++) {
+        if (table[pos].key == hash) {
+            uint32_t index = table[pos].index - 1;
+
+            if (login == str(user_record(index)->login)) {
+                return index;
+            }
+        }
+
+        pos = (pos + 1) & mask;
+    }
+
+    return -1;
+}
+
+int64_t Reader::find_uid(int32_t uid) const
+{
+    const Slot* table = (const Slot*)(data + header->uid_table);
+    uint32_t mask = header->user_slots - 1;
+    uint32_t pos = hash_int(uid) & mask;
+
+    for (uint32_t probe=0;probe<header->user_slots and table[pos].index != 0;probe++) {
+        if (table[pos].key == (uint32_t)uid) {
+            uint32_t index = table[pos].index - 1;
+            expect(index < header->user_count,"Bad user index");
+
+            return index;
+        }
+
+        pos = (pos + 1) & mask;
+    }
+
+    return -1;
+}
+
+int64_t Reader::find_group(const std::string& name) const
+{
+    const Group* groups = (const Group*)(data + header->groups);
+
+    for (uint32_t n=0;n<header->group_count;n++) {
+        if (name == str(groups[n].name)) {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+int64_t Reader::find_gid(int32_t gid) const
+{
+    const Slot* table = (const Slot*)(data + header->gid_table);
+    uint32_t mask = header->group_slots - 1;
+    uint32_t pos = hash_int(gid) & mask;
+
+    for (uint32_t probe=0;probe<header->group_slots and table[pos].index != 0;probe++) {
+        if (table[pos].key == (uint32_t)gid) {
+            uint32_t index = table[pos].index - 1;
+            expect(index < header->group_count,"Bad group index");
+
+            return index;
+        }
+
+        pos = (pos + 1) & mask;
+    }
+
+    return -1;
+}
@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_INDEXED
+#define LLX_GVA_GATE_INDEXED
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/*
+    Indexed user database layout. All integers are little endian and all
+    offsets are relative to the beginning of the file:
+
+    Header
+    User[user_count]      fixed size user records
+    Group[group_count]    fixed size group records, unique by name and gid
+    uint32_t[]            secondary group lists, indexes into Group table
+    Slot[user_slots]      open addressing table by login hash
+    Slot[user_slots]      open addressing table by uid
+    Slot[group_slots]     open addressing table by gid
+    char[]                string pool, null terminated strings
+*/
+
+namespace lliurex
+{
+    namespace indexed
+    {
+        const uint32_t Signature = 0x49584c4c; // LLXI
+        const uint32_t Version = 1;
+        const uint32_t Null = 0xffffffff;
+
+        struct Header
+        {
+            uint32_t signature;
+            uint32_t version;
+            uint32_t magic;
+            uint32_t user_count;
+            uint32_t group_count;
+            uint32_t user_slots;
+            uint32_t group_slots;
+            uint32_t users;
+            uint32_t groups;
+            uint32_t members;
+            uint32_t member_count;
+            uint32_t login_table;
+            uint32_t uid_table;
+            uint32_t gid_table;
+            uint32_t strings;
+            uint32_t strings_size;
+        };
+
+        struct User
+        {
+            uint32_t login;
+            int32_t uid;
+            uint32_t gid;
+            uint32_t name;
+            uint32_t surname;
+            uint32_t home;
+            uint32_t shell;
+            uint32_t method;
+            uint32_t groups;
+            uint32_t group_count;
+        };
+
+        struct Group
+        {
+            uint32_t name;
+            int32_t gid;
+        };
+
+        /*
+            index is stored plus one, so zero means empty slot
+        */
+        struct Slot
+        {
+            uint32_t key;
+            uint32_t index;
+        };
+
+        bool is_indexed(const char* data, size_t size);
+
+        /*!
+            Serializes a user database, either with a group table and gid
+            references or with group structs on every user. Throws if data
+            does not follow user database layout
+        */
+        void dump(std::string magic, edupals::variant::Variant data, std::ostream& stream);
+
+        class Reader
+        {
+            public:
+
+            Reader(const char* data, size_t size);
+
+            std::string magic() const;
+
+            uint32_t users() const
+            {
+                return header->user_count;
+            }
+
+            uint32_t groups() const
+            {
+                return header->group_count;
+            }
+
+            /*!
+                Whole database as Variant, users refer to group table by gid
+            */
+            edupals::variant::Variant load() const;
+
+            edupals::variant::Variant user(uint32_t index) const;
+            edupals::variant::Variant group(uint32_t index) const;
+
+            /*!
+                Returns record index or -1 if not found
+            */
+            int64_t find_login(const std::string& login) const;
+            int64_t find_uid(int32_t uid) const;
+            int64_t find_gid(int32_t gid) const;
+
+            /*!
+                Group table is small and has no name index, it is walked
+            */
+            int64_t find_group(const std::string& name) const;
+
+            protected:
+
+            const char* str(uint32_t offset) const;
+            const User* user_record(uint32_t index) const;
+
+            const char* data;
+            size_t size;
+            const Header* header;
+        };
+    }
+}
+
+#endif
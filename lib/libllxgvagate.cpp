@@ -6,6 +6,7 @@
 #include "filedb.hpp"
 #include "exec.hpp"
 #include "observer.hpp"
+#include "records.hpp"
 
 #include <variant.hpp>
 #include <json.hpp>
@@ -24,6 +25,11 @@
 #include <sstream>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
 #include <ctime>
 
 using namespace lliurex;
@@ -35,20 +41,404 @@ namespace stdfs=std::experimental::filesystem;
 
 #define LLX_GVA_GATE_DEFAULT_EXPIRATION 7 * 1440
 #define LLX_GVA_GATE_MAX_EXPIRATION     30 * 1440
+#define LLX_GVA_GATE_DEFAULT_PERSIST_INTERVAL 300
 #define LLX_GVA_GATE_METHOD_LOCAL   "local"
 
+/* lines parsed and validated at once by import_db */
+#define LLX_GVA_GATE_IMPORT_CHUNK   4096
+
+/*
+    checksum of last user database snapshot that passed validation, shared
+    by every Gate in process. Journal entries are validated by writers
+    before being queued, so only base snapshot needs to be checked
+*/
+static std::mutex validated_mutex;
+static string validated_checksum;
+
+/*
+    Group table unique by name, a later group replaces an earlier one
+*/
+class GroupTable
+{
+    public:
+
+    void add(Variant group)
+    {
+        if (!group.is_struct() or !group["name"].is_string()) {
+            // left for validation to complain about
+            groups.push_back(group);
+            return;
+        }
+
+        string name = group["name"].get_string();
+        auto it = index.find(name);
+
+        if (it != index.end()) {
+            groups[it->second] = group;
+            return;
+        }
+
+        index[name] = groups.size();
+        groups.push_back(group);
+    }
+
+    Variant to_array()
+    {
+        Variant table = Variant::create_array(0);
+
+        for (Variant& group : groups) {
+            table.append(group);
+        }
+
+        return table;
+    }
+
+    protected:
+
+    vector<Variant> groups;
+    unordered_map<string,size_t> index;
+};
+
+/*
+    User record with gid references, groups carried by a user in older
+    layout are moved to table
+*/
+static Variant normalize_user(Variant user, GroupTable& table)
+{
+    if (!user["gid"].is_struct()) {
+        return user;
+    }
+
+    Variant record = Variant::create_struct();
+    record["login"] = user["login"];
+    record["uid"] = user["uid"];
+
+    table.add(user["gid"]);
+    record["gid"] = user["gid"]["gid"];
+
+    Variant refs = Variant::create_array(0);
+    Variant groups = user["groups"];
+
+    for (size_t n=0;n<groups.count();n++) {
+        Variant group = groups[n];
+
+        if (group.is_struct()) {
+            table.add(group);
+            refs.append(group["gid"]);
+        }
+        else {
+            refs.append(group);
+        }
+    }
+
+    record["groups"] = refs;
+    record["name"] = user["name"];
+    record["surname"] = user["surname"];
+    record["home"] = user["home"];
+    record["shell"] = user["shell"];
+
+    if (user["method"].is_string()) {
+        record["method"] = user["method"];
+    }
+
+    return record;
+}
+
+/*
+    Users from older versions may still show up, from a file never
+    rewritten or from journal entries, so data can be mixed
+*/
+static Variant normalize_db(Variant database, GroupTable& table, bool& legacy)
+{
+    legacy = false;
+
+    if (!database.is_struct() or !database["users"].is_array()) {
+        return database;
+    }
+
+    Variant groups = database["groups"];
+
+    if (groups.is_array()) {
+        for (size_t n=0;n<groups.count();n++) {
+            table.add(groups[n]);
+        }
+    }
+    else {
+        legacy = true;
+    }
+
+    Variant users = database["users"];
+    Variant records = Variant::create_array(0);
+
+    for (size_t n=0;n<users.count();n++) {
+        Variant user = users[n];
+
+        if (user["gid"].is_struct()) {
+            legacy = true;
+        }
+
+        records.append(normalize_user(user,table));
+    }
+
+    if (!legacy) {
+        return database;
+    }
+
+    Variant normalized = Variant::create_struct();
+    normalized["users"] = records;
+    normalized["groups"] = table.to_array();
+
+    return normalized;
+}
+
+static Variant normalize_db(Variant database, bool& legacy)
+{
+    GroupTable table;
+
+    return normalize_db(database,table,legacy);
+}
+
+static Variant normalize_db(Variant database)
+{
+    bool legacy;
+
+    return normalize_db(database,legacy);
+}
+
+/*
+    Self-contained user records, as sharded layout stores them
+*/
+static Variant expand_db(Variant database)
+{
+    unordered_map<int32_t,vector<Variant>> by_gid;
+    Variant table = database["groups"];
+
+    for (size_t n=0;n<table.count();n++) {
+        by_gid[table[n]["gid"].get_int32()].push_back(table[n]);
+    }
+
+    Variant users = database["users"];
+    Variant records = Variant::create_array(0);
+
+    for (size_t n=0;n<users.count();n++) {
+        Variant user = users[n];
+
+        if (!user["gid"].is_int32()) {
+            records.append(user);
+            continue;
+        }
+
+        Variant record = Variant::create_struct();
+        record["login"] = user["login"];
+        record["uid"] = user["uid"];
+
+        int32_t gid = user["gid"].get_int32();
+        auto primary = by_gid.find(gid);
+
+        if (primary != by_gid.end()) {
+            record["gid"] = primary->second[0];
+        }
+        else {
+            Variant group = Variant::create_struct();
+            group["name"] = std::to_string(gid);
+            group["gid"] = gid;
+            record["gid"] = group;
+        }
+
+        Variant groups = Variant::create_array(0);
+        Variant refs = user["groups"];
+
+        for (size_t m=0;m<refs.count();m++) {
+            auto it = by_gid.find(refs[m].get_int32());
+
+            if (it != by_gid.end()) {
+                for (Variant& group : it->second) {
+                    groups.append(group);
+                }
+            }
+        }
+
+        record["groups"] = groups;
+        record["name"] = user["name"];
+        record["surname"] = user["surname"];
+        record["home"] = user["home"];
+        record["shell"] = user["shell"];
+
+        if (user["method"].is_string()) {
+            record["method"] = user["method"];
+        }
+
+        records.append(record);
+    }
+
+    Variant expanded = Variant::create_struct();
+    expanded["users"] = records;
+
+    return expanded;
+}
+
+/*
+    passwd entry of a stored user record
+*/
+static Variant passwd_entry(Variant user)
+{
+    Variant ent = Variant::create_struct();
+    ent["key"] = std::to_string(user["uid"].get_int32());
+    ent["name"] = user["login"];
+    ent["uid"] = user["uid"];
+    ent["gid"] = user["gid"];
+    ent["dir"] = user["home"];
+    ent["shell"] = user["shell"];
+    ent["gecos"] = user["surname"].get_string() + "," + user["name"].get_string();
+
+    return ent;
+}
+
+static bool same_passwd(Variant a, Variant b)
+{
+    for (string name : {"key","name","gecos","dir","shell"}) {
+        if (!a[name].is_string() or a[name].get_string() != b[name].get_string()) {
+            return false;
+        }
+    }
+
+    for (string name : {"uid","gid"}) {
+        if (!a[name].is_int32() or a[name].get_int32() != b[name].get_int32()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Group view, one entry per gid with every name it goes by and its
+    members. Being keyed by gid, a writer reaches every entry a user
+    touches from its record alone
+*/
+static Variant group_view(Variant database)
+{
+    vector<Variant> entries;
+    vector<unordered_set<string>> members;
+    unordered_map<int32_t,size_t> by_gid;
+
+    Variant table = database["groups"];
+
+    for (size_t n=0;n<table.count();n++) {
+        int32_t gid = table[n]["gid"].get_int32();
+        auto it = by_gid.find(gid);
+
+        if (it == by_gid.end()) {
+            Variant entry = Variant::create_struct();
+            entry["key"] = std::to_string(gid);
+            entry["gid"] = gid;
+            entry["names"] = Variant::create_array(0);
+            entry["members"] = Variant::create_array(0);
+
+            it = by_gid.emplace(gid,entries.size()).first;
+            entries.push_back(entry);
+            members.push_back(unordered_set<string>());
+        }
+
+        entries[it->second]["names"].append(table[n]["name"]);
+    }
+
+    Variant users = database["users"];
+
+    for (size_t n=0;n<users.count();n++) {
+        Variant user = users[n];
+        Variant refs = user["groups"];
+        string login = user["login"].get_string();
+
+        for (size_t m=0;m<refs.count();m++) {
+            auto it = by_gid.find(refs[m].get_int32());
+
+            if (it != by_gid.end() and members[it->second].insert(login).second) {
+                entries[it->second]["members"].append(login);
+            }
+        }
+    }
+
+    Variant view = Variant::create_array(0);
+
+    for (Variant& entry : entries) {
+        view.append(entry);
+    }
+
+    return view;
+}
+
+/*
+    Normalized database along with its passwd and group views, as
+    written by anything replacing whole user database. Indexed format
+    only keeps users and groups, readers then derive views themselves
+*/
+static Variant with_views(Variant database)
+{
+    Variant passwd = Variant::create_array(0);
+    Variant users = database["users"];
+
+    for (size_t n=0;n<users.count();n++) {
+        passwd.append(passwd_entry(users[n]));
+    }
+
+    Variant views = Variant::create_array(0);
+
+    for (string name : {"passwd","group"}) {
+        Variant marker = Variant::create_struct();
+        marker["name"] = name;
+        views.append(marker);
+    }
+
+    Variant result = Variant::create_struct();
+    result["users"] = users;
+    result["groups"] = database["groups"];
+    result["passwd"] = passwd;
+    result["group"] = group_view(database);
+    result["views"] = views;
+
+    return result;
+}
+
 Gate::Gate() : Gate(nullptr)
 {
 }
 
 Gate::Gate(function<void(int priority,string message)> cb) : log_cb(cb),
-    auth_methods({LLX_GVA_GATE_METHOD_LOCAL}), expiration(LLX_GVA_GATE_DEFAULT_EXPIRATION)
+    expiration(LLX_GVA_GATE_DEFAULT_EXPIRATION), persist_interval(LLX_GVA_GATE_DEFAULT_PERSIST_INTERVAL),
+    runtime_wanted(false), auth_methods({LLX_GVA_GATE_METHOD_LOCAL})
 {
     //log(LOG_DEBUG,"Gate with effective uid:"+std::to_string(geteuid()));
     //load_config();
 
-    userdb = FileDB(LLX_GVA_GATE_USER_DB_PATH,LLX_GVA_GATE_USER_DB_MAGIC);
-    shadowdb = FileDB(LLX_GVA_GATE_SHADOW_DB_PATH,LLX_GVA_GATE_SHADOW_DB_MAGIC);
+    // a live copy in tmpfs means runtime storage has been set up
+    const stdfs::path runtime_db {LLX_GVA_GATE_RUNTIME_USER_DB_PATH};
+    set_storage(stdfs::exists(runtime_db));
+
+    usershards = ShardDB(LLX_GVA_GATE_USER_SHARDS_PATH,LLX_GVA_GATE_USER_DB_MAGIC,"users","login",{"uid"});
+    shadowshards = ShardDB(LLX_GVA_GATE_SHADOW_SHARDS_PATH,LLX_GVA_GATE_SHADOW_DB_MAGIC,"passwords","name");
+    shadowfile = FileStorage(&shadowdb,"passwords","name");
+
+    shadowslots = SlotDB(LLX_GVA_GATE_SHADOW_SLOTS_PATH,LLX_GVA_GATE_SHADOW_DB_MAGIC);
+
+    // users and groups share one file, login is key and uid and gid are indexed
+    sqliteusers = SqliteDB(LLX_GVA_GATE_USER_SQLITE_PATH,LLX_GVA_GATE_USER_DB_MAGIC,"users","login",{"uid","gid"},{"uid"});
+    sqlitegroups = SqliteDB(LLX_GVA_GATE_USER_SQLITE_PATH,LLX_GVA_GATE_USER_DB_MAGIC,"groups","name",{"gid"});
+    sqlitegroups.share(&sqliteusers);
+    sqliteshadow = SqliteDB(LLX_GVA_GATE_SHADOW_SQLITE_PATH,LLX_GVA_GATE_SHADOW_DB_MAGIC,"passwords","name");
+
+    // whatever is on disk wins, config only matters when creating
+    layout = Layout::File;
+
+    if (usershards.exists()) {
+        layout = Layout::Sharded;
+    }
+    else if (sqliteusers.exists()) {
+        layout = Layout::Sqlite;
+    }
+    else if (shadowslots.exists()) {
+        layout = Layout::Slotted;
+    }
 
 }
 
@@ -57,198 +447,1239 @@ Gate::~Gate()
     //log(LOG_DEBUG,"Gate destructor\n");
 }
 
+void Gate::set_storage(bool runtime)
+{
+    this->runtime = runtime;
+
+    // handles are kept open, let go the old ones before replacing them
+    userdb.close();
+    shadowdb.close();
+
+    if (runtime) {
+        userdb = FileDB(LLX_GVA_GATE_RUNTIME_USER_DB_PATH,LLX_GVA_GATE_USER_DB_MAGIC);
+        userdb.set_backing(LLX_GVA_GATE_USER_DB_PATH);
+
+        shadowdb = FileDB(LLX_GVA_GATE_RUNTIME_SHADOW_DB_PATH,LLX_GVA_GATE_SHADOW_DB_MAGIC);
+        shadowdb.set_backing(LLX_GVA_GATE_SHADOW_DB_PATH);
+    }
+    else {
+        userdb = FileDB(LLX_GVA_GATE_USER_DB_PATH,LLX_GVA_GATE_USER_DB_MAGIC);
+        shadowdb = FileDB(LLX_GVA_GATE_SHADOW_DB_PATH,LLX_GVA_GATE_SHADOW_DB_MAGIC);
+    }
+
+    /*
+        long-lived users (greeter, pam stack) skip open and mapping on
+        every call
+    */
+    userdb.set_keep_open(true);
+    shadowdb.set_keep_open(true);
+}
+
+Storage* Gate::user_store()
+{
+    switch (layout) {
+        case Layout::Sharded:
+            return &usershards;
+
+        case Layout::Sqlite:
+            return &sqliteusers;
+
+        default:
+            return nullptr;
+    }
+}
+
+Storage* Gate::group_store()
+{
+    if (layout == Layout::Sqlite) {
+        return &sqlitegroups;
+    }
+
+    return nullptr;
+}
+
+Storage* Gate::shadow_store()
+{
+    switch (layout) {
+        case Layout::Sharded:
+            return &shadowshards;
+
+        case Layout::Sqlite:
+            return &sqliteshadow;
+
+        case Layout::File:
+            return &shadowfile;
+
+        default:
+            return nullptr;
+    }
+}
+
+Variant Gate::read_store()
+{
+    Variant database = user_store()->read();
+
+    if (group_store()) {
+        database["groups"] = group_store()->read()["groups"];
+    }
+
+    return database;
+}
+
+void Gate::write_store(Variant database)
+{
+    if (!group_store()) {
+        user_store()->write(expand_db(database));
+
+        return;
+    }
+
+    // groups first, so no user refers to a missing one, both commit together
+    user_store()->transaction([&]() {
+        group_store()->write(database);
+        user_store()->write(database);
+    });
+}
+
+void Gate::upsert_store(Variant data)
+{
+    string login = data["login"].get_string();
+
+    if (!group_store()) {
+        user_store()->upsert(login,data);
+
+        return;
+    }
+
+    GroupTable table;
+    Variant record = normalize_user(data,table);
+    Variant groups = table.to_array();
+
+    // no reader sees user before its groups, nor groups of a user never stored
+    user_store()->transaction([&]() {
+        for (size_t n=0;n<groups.count();n++) {
+            Variant group = groups[n];
+            string name = group["name"].get_string();
+            Variant current;
+
+            if (group_store()->find(name,current) and current["gid"].is_int32() and
+                current["gid"].get_int32() == group["gid"].get_int32()) {
+                continue;
+            }
+
+            group_store()->upsert(name,group);
+        }
+
+        user_store()->upsert(login,record);
+    });
+}
+
 bool Gate::exists_db(bool root)
 {
+    if (Storage* users = user_store()) {
+        bool status = users->exists();
+
+        if (root) {
+            status = status and shadow_store()->exists();
+        }
+
+        return status;
+    }
+
     bool status = userdb.exists();
 
     if (root) {
-        status = status and shadowdb.exists();
+        status = status and ((layout == Layout::Slotted) ? shadowslots.exists() : shadow_store()->exists());
+    }
+
+    return status;
+}
+
+void Gate::create_db()
+{
+
+    log(LOG_DEBUG,"Creating databases...\n");
+    try {
+        // checking db dir first
+        const stdfs::path dbdir {LLX_GVA_GATE_DB_PATH};
+        stdfs::create_directories(dbdir);
+
+        if (Storage* users = user_store()) {
+            if (!users->exists()) {
+                log(LOG_DEBUG,"Creating user record database\n");
+                users->create(S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
+
+                if (group_store()) {
+                    group_store()->create(S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
+                }
+
+                // migrate current file database
+                if (userdb.exists()) {
+                    AutoLock lock(LockMode::Read,&userdb);
+                    write_store(normalize_db(userdb.read()));
+                }
+
+                Observer::create();
+            }
+
+            Storage* shadows = shadow_store();
+
+            if (!shadows->exists()) {
+                log(LOG_DEBUG,"Creating shadow record database\n");
+                shadows->create(S_IRUSR | S_IRGRP | S_IWUSR);
+
+                if (shadowdb.exists()) {
+                    AutoLock lock(LockMode::Read,&shadowdb);
+                    shadows->write(shadowdb.read());
+                }
+            }
+
+            return;
+        }
+
+        if (runtime) {
+            const stdfs::path rundir {LLX_GVA_GATE_RUNTIME_PATH};
+            stdfs::create_directories(rundir);
+
+            // recovering from last persisted copy
+            if (!userdb.exists() and userdb.restore()) {
+                log(LOG_DEBUG,"Restored user database from " + userdb.get_backing() + "\n");
+                Observer::create();
+            }
+
+            if (!shadowdb.exists() and shadowdb.restore()) {
+                log(LOG_DEBUG,"Restored shadow database from " + shadowdb.get_backing() + "\n");
+            }
+        }
+
+        // user db
+        if (!userdb.exists()) {
+            log(LOG_DEBUG,"Creating user database\n");
+            userdb.create(DBFormat::Bson,S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
+
+            userdb.open();
+
+            userdb.lock_write();
+            Variant user_data = Variant::create_struct();
+            user_data["users"] = Variant::create_array(0);
+            user_data["groups"] = Variant::create_array(0);
+            userdb.write(with_views(user_data));
+            userdb.unlock();
+            userdb.close();
+
+            // creates session shared counter
+            Observer::create();
+        }
+
+        if (layout == Layout::Slotted) {
+            if (!shadowslots.exists()) {
+                log(LOG_DEBUG,"Creating slotted shadow database\n");
+                shadowslots.create(S_IRUSR | S_IRGRP | S_IWUSR);
+
+                if (shadowdb.exists()) {
+                    AutoLock lock(LockMode::Read,&shadowdb);
+                    shadowslots.write(shadowdb.read());
+                }
+            }
+
+            return;
+        }
+
+        // shadow db
+        if (!shadow_store()->exists()) {
+            log(LOG_DEBUG,"Creating shadow database\n");
+            shadow_store()->create(S_IRUSR | S_IRGRP | S_IWUSR);
+        }
+    }
+    catch (std::exception& e) {
+        log(LOG_ERR,"Something went bad creating database\n");
+        log(LOG_ERR, e.what());
+    }
+
+}
+
+Variant Gate::get_user_db()
+{
+    if (user_store()) {
+        return read_store();
+    }
+
+    AutoLock lock(LockMode::Read,&userdb);
+
+    return userdb.read();
+}
+
+Variant Gate::get_shadow_db()
+{
+    if (layout == Layout::Slotted) {
+        return shadowslots.read();
+    }
+
+    return shadow_store()->read();
+}
+
+bool Gate::snapshot_current()
+{
+    if (!observer) {
+        try {
+            observer.reset(new Observer());
+        }
+        catch (std::exception& e) {
+            // no counter to trust, database is read every time
+            log(LOG_DEBUG,string(e.what()) + "\n");
+            return false;
+        }
+    }
+
+    if (observer->changed()) {
+        snapshot = Variant();
+        snapshot_logins.clear();
+        snapshot_gids.clear();
+    }
+
+    return !snapshot.none();
+}
+
+Variant Gate::get_valid_user_db()
+{
+    // counter is checked before reading, a commit racing us forces next reload
+    if (snapshot_current()) {
+        return snapshot;
+    }
+
+    Variant database;
+    string checksum;
+
+    if (user_store()) {
+        database = read_store();
+    }
+    else {
+        AutoLock lock(LockMode::Read,&userdb);
+        database = userdb.read_shared(checksum);
+    }
+
+    // only rebuilt when older layout is found
+    database = normalize_db(database);
+
+    bool validated = false;
+
+    if (checksum.size() > 0) {
+        std::lock_guard<std::mutex> lock(validated_mutex);
+        validated = (checksum == validated_checksum);
+    }
+
+    if (!validated) {
+        string what;
+
+        if (!validate(database,Validator::UserDatabase, what)) {
+            log(LOG_ERR,"Bad user database\n");
+            throw exception::GateError("Bad user database\n:"+ what+ "\n",0);
+        }
+
+        if (checksum.size() > 0) {
+            std::lock_guard<std::mutex> lock(validated_mutex);
+            validated_checksum = checksum;
+        }
+    }
+
+    // kept either way, indexes over it are built again on first lookup
+    snapshot = database;
+    snapshot_logins.clear();
+    snapshot_gids.clear();
+
+    return database;
+}
+
+bool Gate::find_user(const string& login, Variant& out)
+{
+    if (snapshot_current()) {
+        Variant users = snapshot["users"];
+
+        if (snapshot_logins.empty()) {
+            for (size_t n=0;n<users.count();n++) {
+                snapshot_logins.emplace(users[n]["login"].get_string(),n);
+            }
+        }
+
+        auto it = snapshot_logins.find(login);
+
+        if (it == snapshot_logins.end()) {
+            return false;
+        }
+
+        out = users[it->second];
+
+        return true;
+    }
+
+    if (Storage* users = user_store()) {
+        return users->find(login,out);
+    }
+
+    AutoLock lock(LockMode::Read,&userdb);
+
+    return userdb.find("users","login",login,out);
+}
+
+bool Gate::find_shadow(const string& name, Variant& out)
+{
+    if (layout == Layout::Slotted) {
+        return shadowslots.find(name,out);
+    }
+
+    return shadow_store()->find(name,out);
+}
+
+Variant Gate::find_groups(const unordered_set<int32_t>& gids)
+{
+    Variant groups = Variant::create_array(0);
+
+    if (snapshot_current()) {
+        Variant table = snapshot["groups"];
+
+        if (snapshot_gids.empty()) {
+            for (size_t n=0;n<table.count();n++) {
+                snapshot_gids[table[n]["gid"].get_int32()].push_back(n);
+            }
+        }
+
+        for (int32_t gid : gids) {
+            auto it = snapshot_gids.find(gid);
+
+            if (it != snapshot_gids.end()) {
+                for (size_t n : it->second) {
+                    groups.append(table[n]);
+                }
+            }
+        }
+
+        return groups;
+    }
+
+    auto wanted = [&](Variant group) {
+        return (group["gid"].is_int32() and gids.count(group["gid"].get_int32()) > 0);
+    };
+
+    if (Storage* store = group_store()) {
+        store->each([&](Variant group) {
+            if (wanted(group)) {
+                groups.append(group);
+            }
+
+            return true;
+        });
+
+        return groups;
+    }
+
+    AutoLock lock(LockMode::Read,&userdb);
+
+    Variant marker;
+
+    if (userdb.get_format() != DBFormat::Indexed and userdb.find("views","name","group",marker)) {
+        for (int32_t gid : gids) {
+            Variant entry;
+
+            if (!userdb.find("group","key",std::to_string(gid),entry)) {
+                continue;
+            }
+
+            Variant names = entry["names"];
+
+            for (size_t n=0;n<names.count();n++) {
+                Variant group = Variant::create_struct();
+                group["name"] = names[n];
+                group["gid"] = gid;
+
+                groups.append(group);
+            }
+        }
+
+        return groups;
+    }
+
+    // nothing keyed by gid to go through
+    Variant table = userdb.read()["groups"];
+
+    for (size_t n=0;n<table.count();n++) {
+        if (wanted(table[n])) {
+            groups.append(table[n]);
+        }
+    }
+
+    return groups;
+}
+
+void Gate::update_db(Variant data)
+{
+    string what;
+    if (!validate(data,Validator::User, what)) {
+        log(LOG_ERR,"Bad user data\n");
+        throw exception::GateError("Bad user data:\n" + what + "\n",0);
+    }
+
+    if (user_store()) {
+        upsert_store(data);
+        Observer::push();
+
+        return;
+    }
+
+    // validation, normalization and encoding happen before taking lock
+    string ticket;
+    size_t batch;
+
+    {
+        AutoLock lock(LockMode::Read,&userdb);
+        ticket = queue_user(data);
+    }
+
+    {
+        AutoLock user_lock(LockMode::Write,&userdb);
+
+        // state being replaced is taken from what is committed, no writer can change it meanwhile
+        Variant previous = replaced_user(data);
+        batch = userdb.commit(ticket,false);
+
+        // views are built on top of committed state, so no writer misses another
+        string views = queue_views(data,previous);
+
+        if (views.size() > 0) {
+            batch += userdb.commit(views,false);
+        }
+
+        userdb.sync();
+    }
+
+    if (batch > 0) {
+        log(LOG_DEBUG,"user database: committed " + std::to_string(batch) + " updates, lock held " +
+            std::to_string(userdb.last_hold()) + " us\n");
+    }
+
+    //updates shared counter
+    Observer::push();
+
+    compact_if_due();
+    persist_if_due();
+}
+
+Variant Gate::replaced_user(Variant data)
+{
+    Variant previous;
+
+    // indexed files can not hold views, nor be searched for them cheaply
+    Variant marker;
+
+    if (userdb.get_format() == DBFormat::Indexed or !userdb.find("views","name","group",marker)) {
+        return previous;
+    }
+
+    GroupTable table;
+    Variant record = normalize_user(data,table);
+    Variant groups = table.to_array();
+
+    previous = Variant::create_struct();
+    previous["users"] = Variant::create_array(0);
+    previous["gids"] = Variant::create_array(0);
+
+    string login = record["login"].get_string();
+    Variant current;
+
+    if (userdb.find("users","login",login,current)) {
+        previous["users"].append(current);
+    }
+
+    // a different login holding the same uid is about to be dropped
+    Variant holder;
+
+    if (userdb.find("passwd","key",std::to_string(record["uid"].get_int32()),holder) and
+        holder["name"].get_string() != login and
+        userdb.find("users","login",holder["name"].get_string(),current)) {
+        previous["users"].append(current);
+    }
+
+    // name leaves group view entry of its former gid
+    for (size_t n=0;n<groups.count();n++) {
+        Variant group;
+
+        if (userdb.find("groups","name",groups[n]["name"].get_string(),group) and group["gid"].is_int32() and
+            group["gid"].get_int32() != groups[n]["gid"].get_int32()) {
+            previous["gids"].append(group["gid"]);
+        }
+    }
+
+    return previous;
+}
+
+string Gate::queue_user(Variant data)
+{
+    GroupTable table;
+    Variant record = normalize_user(data,table);
+    Variant groups = table.to_array();
+
+    // groups are shared by many users, most of the time already there
+    for (size_t n=0;n<groups.count();n++) {
+        Variant group = groups[n];
+        string name = group["name"].get_string();
+        Variant current;
+
+        if (userdb.find("groups","name",name,current) and current["gid"].is_int32() and
+            current["gid"].get_int32() == group["gid"].get_int32()) {
+            continue;
+        }
+
+        userdb.queue_upsert("groups","name",name,group);
+    }
+
+    // a different login holding the same uid is replaced
+    return userdb.queue_upsert("users","login",record["login"].get_string(),record,{"uid"});
+}
+
+string Gate::queue_views(Variant data, Variant previous)
+{
+    string ticket;
+
+    if (previous.none()) {
+        return ticket;
+    }
+
+    string login = data["login"].get_string();
+    Variant record;
+
+    if (!userdb.find("users","login",login,record)) {
+        return ticket;
+    }
+
+    Variant passwd = passwd_entry(record);
+    Variant stored;
+
+    if (!userdb.find("passwd","key",passwd["key"].get_string(),stored) or !same_passwd(stored,passwd)) {
+        // entry left by this login under a former uid goes away too
+        ticket = userdb.queue_upsert("passwd","key",passwd["key"].get_string(),passwd,{"name"});
+    }
+
+    GroupTable table;
+    normalize_user(data,table);
+    Variant groups = table.to_array();
+
+    // every login whose memberships are rebuilt, current one is added back
+    unordered_set<string> gone;
+    unordered_set<int32_t> member_of;
+    unordered_set<int32_t> gids;
+
+    gone.insert(login);
+
+    Variant users = previous["users"];
+
+    for (size_t n=0;n<users.count();n++) {
+        gone.insert(users[n]["login"].get_string());
+        Variant refs = users[n]["groups"];
+
+        for (size_t m=0;m<refs.count();m++) {
+            gids.insert(refs[m].get_int32());
+        }
+    }
+
+    Variant refs = record["groups"];
+
+    for (size_t n=0;n<refs.count();n++) {
+        member_of.insert(refs[n].get_int32());
+        gids.insert(refs[n].get_int32());
+    }
+
+    for (size_t n=0;n<groups.count();n++) {
+        gids.insert(groups[n]["gid"].get_int32());
+    }
+
+    Variant moved = previous["gids"];
+
+    for (size_t n=0;n<moved.count();n++) {
+        gids.insert(moved[n].get_int32());
+    }
+
+    for (int32_t gid : gids) {
+        string key = std::to_string(gid);
+        Variant entry;
+        bool changed = false;
+
+        Variant names = Variant::create_array(0);
+        Variant members = Variant::create_array(0);
+
+        bool exists = userdb.find("group","key",key,entry);
+        bool was_member = false;
+
+        if (exists) {
+            Variant current = entry["names"];
+
+            for (size_t n=0;n<current.count();n++) {
+                bool kept = true;
+
+                // group table is unique by name, a name now elsewhere leaves
+                for (size_t m=0;m<groups.count();m++) {
+                    if (groups[m]["name"].get_string() == current[n].get_string() and
+                        groups[m]["gid"].get_int32() != gid) {
+                        kept = false;
+                    }
+                }
+
+                if (kept) {
+                    names.append(current[n]);
+                }
+                else {
+                    changed = true;
+                }
+            }
+
+            current = entry["members"];
+
+            for (size_t n=0;n<current.count();n++) {
+                string member = current[n].get_string();
+
+                if (member == login) {
+                    was_member = true;
+                }
+
+                if (gone.find(member) == gone.end()) {
+                    members.append(member);
+                }
+                else if (member != login or member_of.find(gid) == member_of.end()) {
+                    changed = true;
+                }
+            }
+        }
+
+        for (size_t n=0;n<groups.count();n++) {
+            if (groups[n]["gid"].get_int32() != gid) {
+                continue;
+            }
+
+            bool found = false;
+            string name = groups[n]["name"].get_string();
+
+            for (size_t m=0;m<names.count();m++) {
+                if (names[m].get_string() == name) {
+                    found = true;
+                }
+            }
+
+            if (!found) {
+                names.append(name);
+                changed = true;
+            }
+        }
+
+        if (member_of.find(gid) != member_of.end()) {
+            members.append(login);
+            changed = changed or !was_member;
+        }
+
+        if (!exists) {
+            if (names.count() == 0) {
+                // gid missing from group table, as get_groups ignores it
+                continue;
+            }
+
+            changed = true;
+        }
+
+        if (!changed) {
+            continue;
+        }
+
+        if (names.count() == 0) {
+            ticket = userdb.queue_remove("group","key",key);
+            continue;
+        }
+
+        entry = Variant::create_struct();
+        entry["key"] = key;
+        entry["gid"] = gid;
+        entry["names"] = names;
+        entry["members"] = members;
+
+        ticket = userdb.queue_upsert("group","key",key,entry);
+    }
+
+    return ticket;
+}
+
+Variant Gate::create_shadow(const string& name,const string& password)
+{
+    Variant shadow = Variant::create_struct();
+    shadow["name"] = name;
+    shadow["key"] = hash(password,salt(name));
+    shadow["expire"] = (60*expiration) + (int32_t)std::time(nullptr);
+
+    return shadow;
+}
+
+void Gate::update_shadow_db(const string& name,const string& password)
+{
+    Variant shadow = create_shadow(name,password);
+
+    if (layout == Layout::Slotted) {
+        shadowslots.upsert(name,shadow["key"].get_string(),shadow["expire"].get_int32());
+
+        return;
+    }
+
+    // password is hashed above, lock only covers storing it
+    shadow_store()->upsert(name,shadow);
+
+    persist_if_due();
+}
+
+void Gate::update_login(Variant data,const string& name,const string& password)
+{
+    string what;
+    if (!validate(data,Validator::User, what)) {
+        log(LOG_ERR,"Bad user data\n");
+        throw exception::GateError("Bad user data:\n" + what + "\n",0);
+    }
+
+    Variant shadow = create_shadow(name,password);
+
+    if (layout != Layout::File) {
+        // password first and durable once stored, user only after it
+        if (layout == Layout::Slotted) {
+            shadowslots.upsert(name,shadow["key"].get_string(),shadow["expire"].get_int32());
+        }
+        else {
+            shadow_store()->upsert(name,shadow);
+        }
+
+        update_db(data);
+
+        return;
+    }
+
+    string password_ticket = shadowdb.queue_upsert("passwords","name",name,shadow);
+    size_t batch;
+
+    {
+        // user database first, as anyone else taking both
+        AutoLock user_lock(LockMode::Write,&userdb);
+        AutoLock shadow_lock(LockMode::Write,&shadowdb);
+
+        shadowdb.commit(password_ticket,false);
+        shadowdb.sync();
+
+        // user is queued once its password is flushed, so no other writer commits it first
+        Variant previous = replaced_user(data);
+        string ticket = queue_user(data);
+        batch = userdb.commit(ticket,false);
+
+        string views = queue_views(data,previous);
+
+        if (views.size() > 0) {
+            batch += userdb.commit(views,false);
+        }
+
+        userdb.sync();
+    }
+
+    log(LOG_DEBUG,"login " + name + ": committed " + std::to_string(batch) + " user updates, lock held " +
+        std::to_string(userdb.last_hold()) + " us\n");
+
+    Observer::push();
+
+    compact_if_due();
+    persist_if_due();
+}
+
+size_t Gate::import_db(istream& stream, size_t& rejected)
+{
+    size_t workers = std::max(1u,std::thread::hardware_concurrency());
+    size_t line_count = 0;
+
+    rejected = 0;
+
+    // next chunk of valid records in input order, false once input is over
+    auto read_chunk = [&](vector<Variant>& valid) {
+        vector<string> lines;
+        string line;
+
+        valid.clear();
+
+        while (lines.size() < LLX_GVA_GATE_IMPORT_CHUNK and std::getline(stream,line)) {
+            lines.push_back(line);
+        }
+
+        if (lines.size() == 0) {
+            return false;
+        }
+
+        vector<Variant> records(lines.size());
+        vector<string> errors(lines.size());
+        vector<std::thread> threads;
+        size_t slice = (lines.size() + workers - 1) / workers;
+
+        for (size_t w=0;w<workers;w++) {
+            size_t begin = w * slice;
+            size_t end = std::min(begin + slice,lines.size());
+
+            if (begin >= end) {
+                break;
+            }
+
+            threads.push_back(std::thread([&,begin,end]() {
+                for (size_t n=begin;n<end;n++) {
+                    if (lines[n].find_first_not_of(" \t\r") == string::npos) {
+                        continue;
+                    }
+
+                    try {
+                        std::istringstream in(lines[n]);
+                        Variant record = json::load(in);
+                        string what;
+
+                        if (validate(record,Validator::User,what)) {
+                            records[n] = record;
+                        }
+                        else {
+                            errors[n] = what;
+                        }
+                    }
+                    catch (std::exception& e) {
+                        errors[n] = e.what();
+                    }
+                }
+            }));
+        }
+
+        for (std::thread& t : threads) {
+            t.join();
+        }
+
+        for (size_t n=0;n<lines.size();n++) {
+            line_count++;
+
+            if (errors[n].size() > 0) {
+                log(LOG_WARNING,"import: line " + std::to_string(line_count) + ": " + errors[n] + "\n");
+                rejected++;
+                continue;
+            }
+
+            if (!records[n].none()) {
+                valid.push_back(records[n]);
+            }
+        }
+
+        return true;
+    };
+
+    size_t count = 0;
+    vector<Variant> chunk;
+
+    if (user_store()) {
+        /*
+            records go in one chunk at a time, a later one replacing any
+            earlier sharing login or uid, memory stays within a chunk. All
+            of them commit together
+        */
+        user_store()->transaction([&]() {
+            while (read_chunk(chunk)) {
+                for (Variant& record : chunk) {
+                    upsert_store(record);
+                    count++;
+                }
+            }
+        });
+
+        Observer::push();
+
+        return count;
+    }
+
+    /*
+        file database is rewritten as a whole, so memory grows with it
+        anyway. A later record wins over any earlier one sharing login or
+        uid
+    */
+    vector<Variant> imported;
+    unordered_map<string,size_t> by_login;
+    unordered_map<int32_t,size_t> by_uid;
+
+    while (read_chunk(chunk)) {
+        for (Variant& record : chunk) {
+            string login = record["login"].get_string();
+            int32_t uid = record["uid"].get_int32();
+
+            auto other = by_uid.find(uid);
+
+            if (other != by_uid.end() and imported[other->second]["login"].get_string() != login) {
+                by_login.erase(imported[other->second]["login"].get_string());
+                imported[other->second] = Variant();
+            }
+
+            auto current = by_login.find(login);
+
+            if (current != by_login.end()) {
+                by_uid.erase(imported[current->second]["uid"].get_int32());
+                imported[current->second] = record;
+                by_uid[uid] = current->second;
+            }
+            else {
+                imported.push_back(record);
+                by_login[login] = imported.size() - 1;
+                by_uid[uid] = imported.size() - 1;
+            }
+        }
     }
 
-    return status;
-}
+    // may run more than once if a writer races rewrite
+    auto merge = [&](Variant database) {
+        Variant users = Variant::create_array(0);
+        GroupTable table;
 
-void Gate::create_db()
-{
+        count = 0;
 
-    log(LOG_DEBUG,"Creating databases...\n");
-    try {
-        // checking db dir first
-        const stdfs::path dbdir {LLX_GVA_GATE_DB_PATH};
-        stdfs::create_directories(dbdir);
+        bool legacy;
+        Variant current = normalize_db(database,table,legacy)["users"];
 
-        // user db
-        if (!userdb.exists()) {
-            log(LOG_DEBUG,"Creating user database\n");
-            userdb.create(DBFormat::Bson,S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
+        // existing users are kept unless an imported one takes login or uid
+        for (size_t n=0;n<current.count();n++) {
+            Variant user = current[n];
 
-            userdb.open();
+            if (by_login.find(user["login"].get_string()) != by_login.end()) {
+                continue;
+            }
 
-            userdb.lock_write();
-            Variant user_data = Variant::create_struct();
-            user_data["users"] = Variant::create_array(0);
-            userdb.write(user_data);
-            userdb.unlock();
-            userdb.close();
+            if (user["uid"].is_int32() and by_uid.find(user["uid"].get_int32()) != by_uid.end()) {
+                continue;
+            }
 
-            // creates session shared counter
-            Observer::create();
+            users.append(user);
         }
 
-        // shadow db
-        if (!shadowdb.exists()) {
-            log(LOG_DEBUG,"Creating shadow database\n");
-            shadowdb.create(DBFormat::Bson,S_IRUSR | S_IRGRP | S_IWUSR);
+        for (Variant& user : imported) {
+            if (!user.none()) {
+                users.append(normalize_user(user,table));
+                count++;
+            }
+        }
 
-            shadowdb.open();
+        Variant merged = Variant::create_struct();
+        merged["users"] = users;
+        merged["groups"] = table.to_array();
 
-            shadowdb.lock_write();
-            Variant shadow_data = Variant::create_struct();
-            shadow_data["passwords"] = Variant::create_array(0);
-            shadowdb.write(shadow_data);
-            shadowdb.unlock();
-            shadowdb.close();
-        }
-    }
-    catch (std::exception& e) {
-        log(LOG_ERR,"Something went bad creating database\n");
-        log(LOG_ERR, e.what());
-    }
+        return merged;
+    };
 
-}
+    userdb.rewrite([&](Variant database) {
+        return with_views(merge(database));
+    });
 
-Variant Gate::get_user_db()
-{
-    AutoLock lock(LockMode::Read,&userdb);
+    // an import is worth keeping right away
+    persist_db();
 
-    return userdb.read();
+    Observer::push();
+
+    return count;
 }
 
-Variant Gate::get_shadow_db()
+void Gate::purge_user_db()
 {
-    AutoLock shadow_lock(LockMode::Read,&shadowdb);
+    Variant database = Variant::create_struct();
+    database["users"] = Variant::create_array(0);
+    database["groups"] = Variant::create_array(0);
+
+    if (user_store()) {
+        write_store(database);
+        Observer::push();
+
+        return;
+    }
+
+    userdb.rewrite([&](Variant) {
+        return with_views(database);
+    });
 
-    return shadowdb.read();
+    persist_db();
+    Observer::push();
 }
 
-void Gate::update_db(Variant data)
+void Gate::purge_shadow_db()
 {
+    Variant database = Variant::create_struct();
+    database["passwords"] = Variant::create_array(0);
 
-    AutoLock user_lock(LockMode::Write,&userdb);
+    if (layout == Layout::Slotted) {
+        shadowslots.write(database);
 
-    Variant user_data = userdb.read();
-    string what;
-    if (!validate(user_data,Validator::UserDatabase, what)) {
-        log(LOG_ERR,"Bad user database\n");
-        throw exception::GateError("Bad user database:\n" + what + "\n",0);
+        return;
     }
 
-    string login = data["login"].get_string();
-    int32_t uid = data["uid"].get_int32();
+    shadow_store()->write(database);
 
-    Variant tmp = Variant::create_array(0);
+    persist_db();
+}
 
-    for (size_t n=0;n<user_data["users"].count();n++) {
-        Variant user = user_data["users"][n];
+void Gate::persist_db()
+{
+    if (!runtime or user_store()) {
+        return;
+    }
 
-        if (user["login"].get_string() != login and user["uid"].get_int32() != uid) {
-            tmp.append(user);
-        }
+    // persisted copy is a snapshot, writers are not held back
+    {
+        AutoLock user_lock(LockMode::Read,&userdb);
+        userdb.persist();
     }
 
-    tmp.append(data);
+    // slotted shadow records never leave persistent storage
+    if (layout == Layout::File) {
+        AutoLock shadow_lock(LockMode::Read,&shadowdb);
+        shadowdb.persist();
+    }
+
+    log(LOG_DEBUG,"Databases persisted\n");
+}
 
-    user_data["users"] = tmp;
+void Gate::restore_db()
+{
+    if (!runtime_wanted or runtime or user_store()) {
+        return;
+    }
 
-    userdb.write(user_data);
+    set_storage(true);
 
-    //updates shared counter
-    Observer::push();
+    // recovers live copy from persistent storage, or starts an empty one
+    create_db();
 
+    if (!userdb.exists()) {
+        log(LOG_ERR,"Failed to set up runtime storage\n");
+        set_storage(false);
+    }
 }
 
-static Variant find_group(Variant groups, string name, int32_t gid)
+void Gate::persist_if_due()
 {
-    Variant ret;
+    if (!runtime or user_store()) {
+        return;
+    }
 
-    for (size_t n=0;n<groups.count();n++) {
-        Variant group = groups[n];
+    struct stat st;
 
-        if (group["name"].get_string() == name and group["gid"].get_int32()) {
-            return group;
-        }
+    // persisted copy age tells when it was last refreshed
+    if (stat(LLX_GVA_GATE_USER_DB_PATH,&st) == 0 and
+        (std::time(nullptr) - st.st_mtime) < persist_interval) {
+        return;
     }
 
-    return ret;
+    try {
+        persist_db();
+    }
+    catch (std::exception& e) {
+        log(LOG_ERR,"Failed to persist databases\n");
+        log(LOG_DEBUG,string(e.what()) + "\n");
+    }
 }
 
-static void append_member(Variant group,string name)
+Variant Gate::get_lock_stats()
 {
-    bool found = false;
-    for (size_t n=0;n<group.count();n++) {
-        if (group[n].get_string() == name) {
-            found = true;
-            break;
-        }
+    Variant stats = Variant::create_struct();
+
+    if (user_store()) {
+        stats["user"] = user_store()->lock_stats();
+    }
+    else {
+        userdb.open(true);
+        stats["user"] = userdb.lock_stats();
+        userdb.close();
     }
 
-    if (!found) {
-        group.append(name);
+    if (layout == Layout::Slotted) {
+        // slot locks are taken per record and not counted
+        stats["shadow"] = Variant::create_struct();
+
+        return stats;
     }
+
+    stats["shadow"] = shadow_store()->lock_stats();
+
+    return stats;
 }
 
-void Gate::update_shadow_db(string name,string password)
+void Gate::convert_db(DBFormat format)
 {
-    AutoLock shadow_lock(LockMode::Write,&shadowdb);
-
-    Variant database = shadowdb.read();
+    if (user_store()) {
+        log(LOG_WARNING,"Record database has no file format to convert\n");
+        return;
+    }
 
-    bool found = false;
+    userdb.set_format(format);
 
-    for (size_t n=0;n<database["passwords"].count();n++) {
-        Variant shadow = database["passwords"][n];
+    userdb.rewrite([&](Variant current) {
+        Variant database = normalize_db(current);
+        string what;
 
-        if (shadow["name"].get_string() == name) {
-            shadow["key"] = hash(password,salt(name));
-            shadow["expire"] = (60*expiration) + (int32_t)std::time(nullptr);
-            found = true;
-            break;
+        if (!validate(database,Validator::UserDatabase, what)) {
+            log(LOG_ERR,"Bad user database\n");
+            throw exception::GateError("Bad user database:\n" + what + "\n",0);
         }
-    }
 
-    if (!found) {
-        Variant shadow = Variant::create_struct();
-        shadow["name"] = name;
-        shadow["key"] = hash(password,salt(name));
-        shadow["expire"] = (60*expiration) + (int32_t)std::time(nullptr);
-        database["passwords"].append(shadow);
-    }
+        return with_views(database);
+    });
 
-    shadowdb.write(database);
+    {
+        AutoLock user_lock(LockMode::Read,&userdb);
+        userdb.persist();
+    }
 
+    Observer::push();
 }
 
-void Gate::purge_user_db()
+void Gate::compact_db()
 {
-    AutoLock user_lock(LockMode::Write,&userdb);
+    if (user_store()) {
+        // records are rewritten in place, only a log may be left to fold
+        user_store()->compact();
+        shadow_store()->compact();
 
-    Variant database = Variant::create_struct();
-    database["users"] = Variant::create_array(0);
+        return;
+    }
+
+    // rewriting folds journal too
+    userdb.rewrite([&](Variant current) {
+        bool legacy;
+        Variant database = normalize_db(current,legacy);
 
-    userdb.write(database);
+        if (legacy) {
+            log(LOG_INFO,"Moving user groups to group table\n");
+        }
+
+        // views are rebuilt from scratch as well
+        return with_views(database);
+    });
+
+    if (layout == Layout::Slotted) {
+        return;
+    }
+
+    shadow_store()->compact();
 }
 
-void Gate::purge_shadow_db()
+void Gate::compact_if_due()
 {
-    AutoLock shadow_lock(LockMode::Write,&shadowdb);
-
-    Variant database = Variant::create_struct();
-    database["passwords"] = Variant::create_array(0);
+    try {
+        if (userdb.compact_if_due()) {
+            log(LOG_DEBUG,"user database: journal folded, lock held " + std::to_string(userdb.last_hold()) + " us\n");
+        }
 
-    shadowdb.write(database);
+        // logins commit passwords straight to it
+        if (layout == Layout::File and shadowdb.compact_if_due()) {
+            log(LOG_DEBUG,"shadow database: journal folded, lock held " + std::to_string(shadowdb.last_hold()) + " us\n");
+        }
+    }
+    catch (std::exception& e) {
+        // update itself is already safe in journal
+        log(LOG_ERR,"Failed to compact databases\n");
+        log(LOG_DEBUG,string(e.what()) + "\n");
+    }
 }
 
-static string extract_salt(string key)
+static string extract_salt(const string& key)
 {
     vector<int> dollar;
 
@@ -265,124 +1696,116 @@ static string extract_salt(string key)
     return "";
 }
 
-int Gate::lookup_user(string user, Variant& out)
+int Gate::lookup_user(const string& user, Variant& out)
 {
     int status = Gate::UserNotFound;
 
-    AutoLock lock(LockMode::Read,&userdb);
-    Variant database = userdb.read();
+    Variant record;
 
-    string what;
+    if (find_user(user,record)) {
+        GroupTable table;
+        record = normalize_user(record,table);
+        string what;
 
-    if (!validate(database,Validator::UserDatabase, what)) {
-        log(LOG_ERR,"Bad user database\n");
-        throw exception::GateError("Bad user database\n:" + what + "\n",0);
-    }
+        if (!validate(record,Validator::UserRecord, what)) {
+            log(LOG_ERR,"Bad user database\n");
+            throw exception::GateError("Bad user database\n:" + what + "\n",0);
+        }
+
+        // handed out with groups as auth methods send them
+        Variant groups = table.to_array();
+
+        if (groups.count() == 0) {
+            unordered_set<int32_t> gids;
+            gids.insert(record["gid"].get_int32());
 
-    for (size_t n = 0;n < database["users"].count();n++) {
-        if (database["users"][n]["login"].get_string() == user) {
-            out = database["users"][n];
-            break;
+            Variant refs = record["groups"];
+
+            for (size_t n=0;n<refs.count();n++) {
+                gids.insert(refs[n].get_int32());
+            }
+
+            groups = find_groups(gids);
         }
+
+        Variant database = Variant::create_struct();
+        database["users"] = Variant::create_array(0);
+        database["users"].append(record);
+        database["groups"] = groups;
+
+        out = expand_db(database)["users"][0];
     }
 
     return status;
 }
 
-int Gate::lookup_password(string user,string password)
+int Gate::lookup_password(const string& user,const string& password)
 {
-    AutoLock shadow_lock(LockMode::Read,&shadowdb);
     int status = Gate::UserNotFound;
-    Variant database = shadowdb.read();
 
     string username;
     string domain;
 
     truncate_domain(user,username,domain);
 
-    //Validate here
+    Variant shadow;
 
-    for (size_t n=0;n<database["passwords"].count();n++) {
-        Variant shadow = database["passwords"][n];
+    if (!find_shadow(username,shadow)) {
+        return status;
+    }
 
-        if (shadow["name"].get_string() == username) {
-            string stored_hash = shadow["key"].get_string();
-            string stored_salt = extract_salt(stored_hash);
-            string computed_hash = hash(password,stored_salt);
+    string what;
+    ShadowRecord record;
 
-            if (stored_hash == computed_hash) {
-                std::time_t now = std::time(nullptr);
-                int32_t expire = shadow["expire"].get_int32();
+    if (!schema::decode(shadow,record,what)) {
+        log(LOG_ERR,"Bad shadow database\n");
+        throw exception::GateError("Bad shadow database\n:" + what + "\n",0);
+    }
 
-                if (now<expire) {
-                    status = Gate::Allowed;
-                    break;
-                }
-                else {
-                    status = Gate::ExpiredPassword;
-                    break;
-                }
+    string stored_salt = extract_salt(record.key);
+    string computed_hash = hash(password,stored_salt);
 
-            }
-            else {
-                status = Gate::InvalidPassword;
-                break;
-            }
+    if (record.key == computed_hash) {
+        std::time_t now = std::time(nullptr);
+
+        if (now<record.expire) {
+            status = Gate::Allowed;
+        }
+        else {
+            status = Gate::ExpiredPassword;
         }
     }
+    else {
+        status = Gate::InvalidPassword;
+    }
 
     return status;
 }
 
 Variant Gate::get_groups()
 {
-    Variant groups;
-
-    AutoLock lock(LockMode::Read,&userdb);
+    Variant database = get_valid_user_db();
+    Variant view = database["group"];
 
-    Variant database = userdb.read();
-    string what;
-
-    if (!validate(database,Validator::UserDatabase, what)) {
-        log(LOG_ERR,"Bad user database\n");
-        throw exception::GateError("Bad user database\n:"+ what+ "\n",0);
+    // files without views, or in a format unable to hold them
+    if (!database["views"].is_array() or !view.is_array()) {
+        view = group_view(database);
     }
 
-    groups = Variant::create_array(0);
-
-    for (size_t n=0;n<database["users"].count();n++) {
-        Variant user = database["users"][n];
-
-        Variant main_group = user["gid"];
-        string mgname = user["gid"]["name"].get_string();
-        int32_t mgid = user["gid"]["gid"].get_int32();
-        main_group = find_group(groups,mgname,mgid);
-
-        if (main_group.none()) {
-            main_group = Variant::create_struct();
-            main_group["name"] = mgname;
-            main_group["gid"] = mgid;
-            main_group["members"] = Variant::create_array(0);
-            groups.append(main_group);
-        }
+    Variant groups = Variant::create_array(0);
 
-        for (size_t n=0;n<user["groups"].count();n++) {
-            string gname = user["groups"][n]["name"].get_string();
-            int32_t gid = user["groups"][n]["gid"].get_int32();
+    // every name sharing a gid gets its members
+    for (size_t n=0;n<view.count();n++) {
+        Variant entry = view[n];
+        Variant names = entry["names"];
 
-            Variant group = find_group(groups,gname,gid);
+        for (size_t m=0;m<names.count();m++) {
+            Variant group = Variant::create_struct();
+            group["name"] = names[m];
+            group["gid"] = entry["gid"];
+            group["members"] = entry["members"];
 
-            if (group.none()) {
-                group = Variant::create_struct();
-                group["name"] = gname;
-                group["gid"] = gid;
-                group["members"] = Variant::create_array(0);
-                append_member(group["members"],user["login"].get_string());
-                groups.append(group);
-            }
-            else {
-                append_member(group["members"],user["login"].get_string());
-            }
+            groups.append(group);
         }
     }
 
@@ -391,33 +1814,16 @@ Variant Gate::get_groups()
 
 Variant Gate::get_users()
 {
-    Variant users;
-
-    AutoLock lock(LockMode::Read,&userdb);
-    Variant database = userdb.read();
+    Variant database = get_valid_user_db();
 
-    //Variant user_data = userdb.read();
-    string what;
-    if (!validate(database,Validator::UserDatabase, what)) {
-        log(LOG_ERR,"Bad user database\n");
-        throw exception::GateError("Bad user database\n:" + what + "\n",0);
+    if (database["views"].is_array() and database["passwd"].is_array()) {
+        return database["passwd"];
     }
 
-    users = Variant::create_array(0);
+    Variant users = Variant::create_array(0);
 
     for (size_t n=0;n<database["users"].count();n++) {
-        Variant user = database["users"][n];
-
-        Variant ent = Variant::create_struct();
-        ent["name"] = user["login"];
-        ent["uid"] = user["uid"];
-        ent["gid"] = user["gid"]["gid"];
-        ent["dir"] = user["home"];
-        ent["shell"] = user["shell"];
-        string gecos = user["surname"].get_string() + "," +user["name"].get_string();
-        ent["gecos"] = gecos;
-
-        users.append(ent);
+        users.append(passwd_entry(database["users"][n]));
     }
 
     return users;
@@ -425,8 +1831,7 @@ Variant Gate::get_users()
 
 Variant Gate::get_cache()
 {
-    AutoLock shadow_lock(LockMode::Read,&shadowdb);
-    Variant database = shadowdb.read();
+    Variant database = get_shadow_db();
 
     Variant cache = Variant::create_array(0);
 
@@ -450,6 +1855,18 @@ void Gate::set_logger(function<void(int priority,string message)> cb)
     this->log_cb = cb;
 }
 
+void Gate::set_lock_timeout(int32_t timeout)
+{
+    userdb.set_lock_timeout(timeout);
+    shadowdb.set_lock_timeout(timeout);
+    usershards.set_lock_timeout(timeout);
+    shadowshards.set_lock_timeout(timeout);
+    sqliteusers.set_lock_timeout(timeout);
+    sqlitegroups.set_lock_timeout(timeout);
+    sqliteshadow.set_lock_timeout(timeout);
+    shadowslots.set_lock_timeout(timeout);
+}
+
 Variant Gate::create_empty_user()
 {
     Variant user = Variant::create_struct();
@@ -464,7 +1881,7 @@ Variant Gate::create_empty_user()
     return user;
 }
 
-int Gate::auth_exec(string method, string user, string password, Variant& out)
+int Gate::auth_exec(const string& method, const string& user, const string& password, Variant& out)
 {
     int status = Gate::Error;
 
@@ -480,8 +1897,7 @@ int Gate::auth_exec(string method, string user, string password, Variant& out)
 
             if (status == Gate::Allowed) {
                 data["user"]["method"] = method;
-                update_db(data["user"]);
-                update_shadow_db(user,password);
+                update_login(data["user"],user,password);
 
                 out = data;
             }
@@ -501,7 +1917,7 @@ int Gate::auth_exec(string method, string user, string password, Variant& out)
     return status;
 }
 
-bool Gate::truncate_domain(string user, string& username, string& domain)
+bool Gate::truncate_domain(const string& user, string& username, string& domain)
 {
     std::size_t found = user.find("@");
 
@@ -520,7 +1936,7 @@ bool Gate::truncate_domain(string user, string& username, string& domain)
 
 }
 
-int Gate::authenticate(string user,string password, Variant& out)
+int Gate::authenticate(const string& user,const string& password, Variant& out)
 {
     int status = Gate::Error;
     out = create_empty_user();
@@ -535,7 +1951,7 @@ int Gate::authenticate(string user,string password, Variant& out)
         log(LOG_DEBUG,"domain:"+domain+"\n");
     }
 
-    for (string method : auth_methods) {
+    for (const string& method : auth_methods) {
 
         if (status == Gate::Error or status == Gate::UserNotFound) {
 
@@ -564,7 +1980,7 @@ int Gate::authenticate(string user,string password, Variant& out)
     return status;
 }
 
-void Gate::log(int priority, string message)
+void Gate::log(int priority, const string& message)
 {
     if (log_cb) {
         log_cb(priority,message);
@@ -593,23 +2009,10 @@ bool Gate::validate(Variant data,Validator validator, string& what)
 
         break;
 
-        case Validator::Group:
-            if (!data.is_struct()) {
-                what = "Group type is not Struct";
-                return false;
-            }
-
-            if (!data["name"].is_string()) {
-                what = "Expected field name with type String";
-                return false;
-            }
-
-            if (!data["gid"].is_int32()) {
-                what = "Expected field gid with type Int32";
-                return false;
-            }
-
-            return true;
+        case Validator::Group: {
+            GroupRef record;
+            return schema::decode(data,record,what);
+        }
         break;
 
         case Validator::UserDatabase:
@@ -618,7 +2021,11 @@ bool Gate::validate(Variant data,Validator validator, string& what)
                 return false;
             }
 
-            return validate(data["users"],Validator::Users, what);
+            if (!validate(data["users"],Validator::Users, what)) {
+                return false;
+            }
+
+            return validate(data["groups"],Validator::Groups, what);
         break;
 
         case Validator::ShadowDatabase:
@@ -647,28 +2054,10 @@ bool Gate::validate(Variant data,Validator validator, string& what)
             return true;
         break;
 
-        case Validator::Shadow:
-            if (!data.is_struct()) {
-                what = "Shadow type is not a Struct";
-                return false;
-            }
-
-            if (!data["name"].is_string()) {
-                what = "Expected field name with type String";
-                return false;
-            }
-
-            if (!data["key"].is_string()) {
-                what = "Expected field key with type String";
-                return false;
-            }
-
-            if (!data["expire"].is_int32()) {
-                what = "Expected field expire with type Int32";
-                return false;
-            }
-
-            return true;
+        case Validator::Shadow: {
+            ShadowRecord record;
+            return schema::decode(data,record,what);
+        }
         break;
 
         case Validator::Users:
@@ -678,18 +2067,32 @@ bool Gate::validate(Variant data,Validator validator, string& what)
             }
 
             for (size_t n=0;n<data.count();n++) {
-                return validate(data[n],Validator::User, what);
+                if (!validate(data[n],Validator::UserRecord, what)) {
+                    return false;
+                }
             }
 
             return true;
         break;
 
+        case Validator::UserRecord: {
+            UserRecord record;
+            return schema::decode(data,record,what);
+        }
+        break;
+
         case Validator::User:
             if (!data["login"].is_string()) {
                 what = "Expected field login with type String";
                 return false;
             }
 
+            // refused here rather than failing once its password is stored
+            if (layout == Layout::Slotted and !SlotDB::fits(data["login"].get_string())) {
+                what = "Field login is too long for slotted layout";
+                return false;
+            }
+
             if (!data["uid"].is_int32()) {
                 what = "Expected field uid with type Int32";
                 return false;
@@ -746,7 +2149,7 @@ bool Gate::validate(Variant data,Validator validator, string& what)
     }
 }
 
-string Gate::salt(string username)
+string Gate::salt(const string& username)
 {
     string value;
     const int range = 'z' - 'A';
@@ -763,45 +2166,48 @@ string Gate::salt(string username)
     return value;
 }
 
-string Gate::hash(string password,string salt)
+string Gate::hash(const string& password,const string& salt)
 {
-    salt = "$6$" + salt + "$";
-    char* data = crypt(password.c_str(),salt.c_str());
+    string setting = "$6$" + salt + "$";
+    char* data = crypt(password.c_str(),setting.c_str());
 
     return string(data);
 }
 
-bool Gate::get_pwnam(string user_name, struct passwd* user_info)
+bool Gate::get_pwnam(const string& user_name, struct passwd* user_info)
 {
     if (!user_info) {
         return false;
     }
 
-    Variant users = get_users();
+    Variant user;
 
+    if (!find_user(user_name,user)) {
+        return false;
+    }
 
-    for (size_t n=0;n<users.count();n++) {
-        Variant user = users[n];
-
-        if (user["name"].get_string() == user_name) {
+    GroupTable table;
+    string what;
+    UserRecord record;
 
-            pw_name = user["name"].get_string();
-            pw_dir = user["dir"].get_string();
-            pw_shell = user["shell"].get_string();
-            pw_gecos = user["gecos"].get_string();
+    if (!schema::decode(normalize_user(user,table),record,what)) {
+        log(LOG_ERR,"Bad user database\n");
+        throw exception::GateError("Bad user database\n:" + what + "\n",0);
+    }
 
-            user_info->pw_name = (char*) pw_name.c_str();
-            user_info->pw_uid = user["uid"].get_int32();
-            user_info->pw_gid = user["gid"].get_int32();
-            user_info->pw_dir = (char*)pw_dir.c_str();
-            user_info->pw_shell = (char*)pw_shell.c_str();
-            user_info->pw_gecos = (char*)pw_gecos.c_str();
+    pw_name = std::move(record.login);
+    pw_dir = std::move(record.home);
+    pw_shell = std::move(record.shell);
+    pw_gecos = record.surname + "," + record.name;
 
-            return true;
-        }
-    }
+    user_info->pw_name = (char*) pw_name.c_str();
+    user_info->pw_uid = record.uid;
+    user_info->pw_gid = record.gid;
+    user_info->pw_dir = (char*)pw_dir.c_str();
+    user_info->pw_shell = (char*)pw_shell.c_str();
+    user_info->pw_gecos = (char*)pw_gecos.c_str();
 
-    return false;
+    return true;
 }
 
 void Gate::load_config()
@@ -855,6 +2261,92 @@ void Gate::load_config()
                     auth_methods.push_back(LLX_GVA_GATE_METHOD_LOCAL);
                 }
             }
+
+            // goes first, it replaces database handles
+            if (cfg["storage"].is_string()) {
+                string value = cfg["storage"].get_string();
+
+                if (value == "runtime") {
+                    runtime_wanted = true;
+
+                    if (!runtime) {
+                        set_storage(true);
+
+                        // live copy is recovered at boot by restore_db()
+                        if (!userdb.exists()) {
+                            log(LOG_WARNING,"Runtime storage is not available yet\n");
+                            set_storage(false);
+                        }
+                    }
+                }
+                else if (value == "disk") {
+                    if (runtime) {
+                        log(LOG_WARNING,"Runtime storage in use until " LLX_GVA_GATE_RUNTIME_PATH " is removed\n");
+                    }
+                }
+                else {
+                    log(LOG_WARNING,"Unknown storage " + value + ", expected disk or runtime\n");
+                }
+            }
+
+            if (cfg["durability"].is_string()) {
+                string value = cfg["durability"].get_string();
+                Durability durability = Durability::Full;
+
+                if (value == "full") {
+                    durability = Durability::Full;
+                }
+                else if (value == "file") {
+                    durability = Durability::File;
+                }
+                else if (value == "none") {
+                    durability = Durability::None;
+                }
+                else {
+                    log(LOG_WARNING,"Unknown durability " + value + ", expected full, file or none\n");
+                }
+
+                userdb.set_durability(durability);
+                shadowdb.set_durability(durability);
+                usershards.set_durability(durability);
+                shadowshards.set_durability(durability);
+                sqliteusers.set_durability(durability);
+                sqlitegroups.set_durability(durability);
+                sqliteshadow.set_durability(durability);
+                shadowslots.set_durability(durability);
+            }
+
+            if (cfg["lock_timeout"].is_int32()) {
+                set_lock_timeout(std::max(0,cfg["lock_timeout"].get_int32()));
+            }
+
+            if (cfg["persist_interval"].is_int32()) {
+                persist_interval = std::max(0,cfg["persist_interval"].get_int32());
+            }
+
+            if (cfg["layout"].is_string()) {
+                string value = cfg["layout"].get_string();
+
+                // an existing record database is kept
+                if (value == "sharded") {
+                    if (layout != Layout::Sqlite) {
+                        layout = Layout::Sharded;
+                    }
+                }
+                else if (value == "sqlite") {
+                    if (layout != Layout::Sharded) {
+                        layout = Layout::Sqlite;
+                    }
+                }
+                else if (value == "slotted") {
+                    if (layout == Layout::File) {
+                        layout = Layout::Slotted;
+                    }
+                }
+                else if (value != "file") {
+                    log(LOG_WARNING,"Unknown layout " + value + ", expected file, sharded, slotted or sqlite\n");
+                }
+            }
         }
         catch (std::exception& e) {
             log(LOG_WARNING,"Failed to parse config file\n");
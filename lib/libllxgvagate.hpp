@@ -6,6 +6,12 @@
 #define LLX_GVA_GATE
 
 #include "filedb.hpp"
+#include "filestorage.hpp"
+#include "observer.hpp"
+#include "sharddb.hpp"
+#include "slotdb.hpp"
+#include "sqlitedb.hpp"
+#include "storage.hpp"
 
 #include <variant.hpp>
 
@@ -13,11 +19,19 @@
 #include <pwd.h>
 
 #include <cstdio>
+#include <istream>
 #include <functional>
+#include <memory>
 #include <string>
 #include <exception>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+/* both may be set at build time, tests keep their databases elsewhere */
+#ifndef LLX_GVA_GATE_DB_PATH
 #define LLX_GVA_GATE_DB_PATH "/var/lib/llx-gva-gate/"
+#endif
 
 #define LLX_GVA_GATE_USER_DB_MAGIC "LLX-USERDB"
 #define LLX_GVA_GATE_USER_DB_FILE "user.db"
@@ -27,6 +41,20 @@
 #define LLX_GVA_GATE_SHADOW_DB_FILE "shadow.db"
 #define LLX_GVA_GATE_SHADOW_DB_PATH LLX_GVA_GATE_DB_PATH LLX_GVA_GATE_SHADOW_DB_FILE
 
+#ifndef LLX_GVA_GATE_RUNTIME_PATH
+#define LLX_GVA_GATE_RUNTIME_PATH "/run/llx-gva-gate/"
+#endif
+#define LLX_GVA_GATE_RUNTIME_USER_DB_PATH LLX_GVA_GATE_RUNTIME_PATH LLX_GVA_GATE_USER_DB_FILE
+#define LLX_GVA_GATE_RUNTIME_SHADOW_DB_PATH LLX_GVA_GATE_RUNTIME_PATH LLX_GVA_GATE_SHADOW_DB_FILE
+
+#define LLX_GVA_GATE_USER_SHARDS_PATH LLX_GVA_GATE_DB_PATH "users"
+#define LLX_GVA_GATE_SHADOW_SHARDS_PATH LLX_GVA_GATE_DB_PATH "shadow"
+
+#define LLX_GVA_GATE_SHADOW_SLOTS_PATH LLX_GVA_GATE_DB_PATH "shadow.slots"
+
+#define LLX_GVA_GATE_USER_SQLITE_PATH LLX_GVA_GATE_DB_PATH "user.sqlite"
+#define LLX_GVA_GATE_SHADOW_SQLITE_PATH LLX_GVA_GATE_DB_PATH "shadow.sqlite"
+
 namespace lliurex
 {
     enum class Validator {
@@ -35,17 +63,24 @@ namespace lliurex
         Shadows,
         Shadow,
         Users,
+        /* stored user, groups referred by gid */
+        UserRecord,
+        /* user as sent by auth methods, with group structs */
         User,
         Groups,
         Group,
         Authenticate
     };
 
-    enum LookupStatus {
-        Found,
-        NotFound,
-        InvalidPassword,
-        ExpiredPassword
+    enum class Layout {
+        /* one database file for all users */
+        File,
+        /* one record file per user */
+        Sharded,
+        /* user database file, shadow records in fixed slots */
+        Slotted,
+        /* SQLite tables in WAL mode */
+        Sqlite
     };
 
     namespace exception
@@ -111,44 +146,187 @@ namespace lliurex
         edupals::variant::Variant get_shadow_db();
 
         void update_db(edupals::variant::Variant data);
-        void update_shadow_db(std::string user,std::string password);
+        void update_shadow_db(const std::string& user,const std::string& password);
 
-        int lookup_user(std::string user, edupals::variant::Variant& out);
-        int lookup_password(std::string user,std::string password);
+        /*!
+            Updates cached password and then its user. Both write locks are
+            taken once, password is committed and flushed before user is
+            queued, so it never shows up without it
+        */
+        void update_login(edupals::variant::Variant data,const std::string& user,const std::string& password);
+
+        int lookup_user(const std::string& user, edupals::variant::Variant& out);
+        int lookup_password(const std::string& user,const std::string& password);
 
         edupals::variant::Variant get_groups();
         edupals::variant::Variant get_users();
         edupals::variant::Variant get_cache();
 
+        /*!
+            Merges user records, one JSON document per line, into user
+            database with a single commit. Record stores get input one
+            chunk at a time, file database is rewritten whole. Returns how
+            many users were imported, records failing validation are
+            logged and counted as rejected
+        */
+        size_t import_db(std::istream& stream, size_t& rejected);
+
         void purge_user_db();
         void purge_shadow_db();
 
-        int authenticate(std::string user,std::string password, edupals::variant::Variant& out);
+        void compact_db();
+
+        /*!
+            Copies live databases from tmpfs to persistent storage, does
+            nothing unless runtime storage is in use
+        */
+        void persist_db();
+
+        /*!
+            Same as persist_db(), once persisted copy is older than
+            persist_interval
+        */
+        void persist_if_due();
+
+        /*!
+            Sets up runtime storage from last persisted copy when config
+            asks for it, meant to be run once at boot
+        */
+        void restore_db();
+
+        /*!
+            Lock counters of user and shadow databases
+        */
+        edupals::variant::Variant get_lock_stats();
+
+        /*!
+            Rewrites user database using given format
+        */
+        void convert_db(DBFormat format);
+
+        int authenticate(const std::string& user,const std::string& password, edupals::variant::Variant& out);
 
         bool validate(edupals::variant::Variant data,Validator validator,std::string& what);
 
         void set_logger(std::function<void(int priority,std::string message)> cb);
 
-        std::string salt(std::string username);
-        std::string hash(std::string password,std::string salt);
+        /*!
+            Deadline for database locks in milliseconds, zero waits forever
+        */
+        void set_lock_timeout(int32_t timeout);
 
-        bool get_pwnam(std::string user_name, struct passwd* user_info);
+        std::string salt(const std::string& username);
+        std::string hash(const std::string& password,const std::string& salt);
+
+        bool get_pwnam(const std::string& user_name, struct passwd* user_info);
 
         protected:
 
         edupals::variant::Variant create_empty_user();
-
-        int auth_exec(std::string method, std::string user, std::string password, edupals::variant::Variant& out);
-        void log(int priority, std::string message);
-        bool truncate_domain(std::string user, std::string& username, std::string& domain);
+        edupals::variant::Variant create_shadow(const std::string& name,const std::string& password);
+
+        /*!
+            Queues groups of user missing from group table and user record
+            referring to them, returns ticket of user record. A lock is
+            expected
+        */
+        std::string queue_user(edupals::variant::Variant data);
+
+        /*!
+            What queue_views() needs to know about committed state a user
+            is about to replace, none unless database keeps views. Write
+            lock is expected, taken before committing user
+        */
+        edupals::variant::Variant replaced_user(edupals::variant::Variant data);
+
+        /*!
+            Updates passwd and group views for a committed user, only
+            entries it touches are rewritten. A write lock is expected,
+            returns ticket of last queued change or empty if none
+        */
+        std::string queue_views(edupals::variant::Variant data, edupals::variant::Variant previous);
+
+        /*!
+            User database with group table, validation is skipped when its
+            base snapshot already passed it in this process. Result is kept
+            and handed out again until Observer reports a commit, it must
+            not be modified
+        */
+        edupals::variant::Variant get_valid_user_db();
+
+        /*!
+            Whether kept user database is still current, it is dropped as
+            soon as Observer counter moves
+        */
+        bool snapshot_current();
+
+        /*!
+            Record backends of current layout, null when user database is
+            a FileDB file. Group table only has its own store when records
+            are normalized. Shadow file is reached through an adapter, so
+            shadow store is only null for slotted layout
+        */
+        Storage* user_store();
+        Storage* group_store();
+        Storage* shadow_store();
+
+        /*!
+            User database through record backends, same layout FileDB
+            holds
+        */
+        edupals::variant::Variant read_store();
+        void write_store(edupals::variant::Variant database);
+        void upsert_store(edupals::variant::Variant data);
+
+        void set_storage(bool runtime);
+
+        /*!
+            Folds user journal once grown past its limit, outside of any
+            lock. Shadow file adapter folds its own
+        */
+        void compact_if_due();
+
+        bool find_user(const std::string& login, edupals::variant::Variant& out);
+        bool find_shadow(const std::string& name, edupals::variant::Variant& out);
+
+        /*!
+            Groups of table carrying any of gids, reached through group view
+            or store when there is no snapshot to look them up in
+        */
+        edupals::variant::Variant find_groups(const std::unordered_set<int32_t>& gids);
+
+        int auth_exec(const std::string& method, const std::string& user, const std::string& password,
+                      edupals::variant::Variant& out);
+        void log(int priority, const std::string& message);
+        bool truncate_domain(const std::string& user, std::string& username, std::string& domain);
 
         std::function<void(int priority,std::string message)> log_cb;
 
         FileDB userdb;
         FileDB shadowdb;
 
+        FileStorage shadowfile;
+
+        ShardDB usershards;
+        ShardDB shadowshards;
+
+        SlotDB shadowslots;
+
+        SqliteDB sqliteusers;
+        SqliteDB sqlitegroups;
+        SqliteDB sqliteshadow;
+
+        std::unique_ptr<Observer> observer;
+        edupals::variant::Variant snapshot;
+        std::unordered_map<std::string,size_t> snapshot_logins;
+        std::unordered_map<int32_t,std::vector<size_t>> snapshot_gids;
+
         /* config */
         int32_t expiration;
+        Layout layout;
+        bool runtime;
+        int32_t persist_interval;
+        bool runtime_wanted;
 
         // used for pwd pointer storage
         std::string pw_name;
@@ -12,7 +12,9 @@
 #include <climits>
 #include <stdexcept>
 
+#ifndef GVA_GATE_SHARED
 #define GVA_GATE_SHARED "/net.lliurex.gvagate.db"
+#endif
 
 using namespace lliurex;
 using namespace std;
@@ -61,8 +63,10 @@ bool Observer::changed()
     }
 
     if (counter_ptr) {
-        if (*counter_ptr != current) {
-            current = *counter_ptr;
+        uint32_t value = __atomic_load_n(counter_ptr,__ATOMIC_ACQUIRE);
+
+        if (value != current) {
+            current = value;
 
             return true;
         }
@@ -110,7 +114,8 @@ void Observer::push()
         throw runtime_error("Failed to map shared memory");
     }
 
-    *ptr = *ptr + 1;
+    // writers may push at once, none of them can be lost
+    __atomic_add_fetch(ptr,1,__ATOMIC_RELEASE);
 
     close(fd);
 
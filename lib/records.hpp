@@ -0,0 +1,193 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_RECORDS
+#define LLX_GVA_GATE_RECORDS
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace lliurex
+{
+    /*!
+        Group as sent by auth methods
+    */
+    struct GroupRef
+    {
+        std::string name;
+        int32_t gid;
+    };
+
+    /*!
+        Stored user, groups referred by gid
+    */
+    struct UserRecord
+    {
+        std::string login;
+        int32_t uid;
+        int32_t gid;
+        std::vector<int32_t> groups;
+        std::string name;
+        std::string surname;
+        std::string home;
+        std::string shell;
+        std::string method;
+    };
+
+    struct ShadowRecord
+    {
+        std::string name;
+        std::string key;
+        int32_t expire;
+    };
+
+    namespace schema
+    {
+        template <class T, class M>
+        struct Field
+        {
+            const char* name;
+            M T::* member;
+            /* may be missing, left empty then */
+            bool optional;
+        };
+
+        template <class T, class M>
+        constexpr Field<T,M> field(const char* name, M T::* member, bool optional = false)
+        {
+            return Field<T,M> {name,member,optional};
+        }
+
+        /*!
+            Fields of each record type, in the order they are checked
+        */
+        template <class T>
+        struct Schema;
+
+        template <>
+        struct Schema<GroupRef>
+        {
+            static constexpr const char* name = "Group";
+
+            static constexpr auto fields = std::make_tuple(
+                field("name",&GroupRef::name),
+                field("gid",&GroupRef::gid)
+            );
+        };
+
+        template <>
+        struct Schema<UserRecord>
+        {
+            static constexpr const char* name = "UserRecord";
+
+            static constexpr auto fields = std::make_tuple(
+                field("login",&UserRecord::login),
+                field("uid",&UserRecord::uid),
+                field("gid",&UserRecord::gid),
+                field("name",&UserRecord::name),
+                field("surname",&UserRecord::surname),
+                field("home",&UserRecord::home),
+                field("shell",&UserRecord::shell),
+                field("groups",&UserRecord::groups),
+                field("method",&UserRecord::method,true)
+            );
+        };
+
+        template <>
+        struct Schema<ShadowRecord>
+        {
+            static constexpr const char* name = "Shadow";
+
+            static constexpr auto fields = std::make_tuple(
+                field("name",&ShadowRecord::name),
+                field("key",&ShadowRecord::key),
+                field("expire",&ShadowRecord::expire)
+            );
+        };
+
+        inline bool decode_value(edupals::variant::Variant value, const char* name, std::string& out,
+                                 std::string& what)
+        {
+            if (!value.is_string()) {
+                what = std::string("Expected field ") + name + " with type String";
+                return false;
+            }
+
+            out = value.get_string();
+
+            return true;
+        }
+
+        inline bool decode_value(edupals::variant::Variant value, const char* name, int32_t& out,
+                                 std::string& what)
+        {
+            if (!value.is_int32()) {
+                what = std::string("Expected field ") + name + " with type Int32";
+                return false;
+            }
+
+            out = value.get_int32();
+
+            return true;
+        }
+
+        inline bool decode_value(edupals::variant::Variant value, const char* name, std::vector<int32_t>& out,
+                                 std::string& what)
+        {
+            if (!value.is_array()) {
+                what = std::string("Expected field ") + name + " with type Array";
+                return false;
+            }
+
+            out.clear();
+            out.reserve(value.count());
+
+            for (size_t n=0;n<value.count();n++) {
+                if (!value[n].is_int32()) {
+                    what = "Expected group reference with type Int32";
+                    return false;
+                }
+
+                out.push_back(value[n].get_int32());
+            }
+
+            return true;
+        }
+
+        template <class T, class M>
+        bool decode_field(edupals::variant::Variant data, const Field<T,M>& field, T& out, std::string& what)
+        {
+            edupals::variant::Variant value = data[field.name];
+
+            if (field.optional and value.none()) {
+                return true;
+            }
+
+            return decode_value(value,field.name,out.*(field.member),what);
+        }
+
+        /*!
+            Checks types and fills record in a single pass over its schema,
+            stops at first bad field and tells which one in what
+        */
+        template <class T>
+        bool decode(edupals::variant::Variant data, T& out, std::string& what)
+        {
+            if (!data.is_struct()) {
+                what = std::string(Schema<T>::name) + " type is not a Struct";
+                return false;
+            }
+
+            return std::apply([&](const auto&... fields) {
+                return (decode_field(data,fields,out,what) and ...);
+            },Schema<T>::fields);
+        }
+    }
+}
+
+#endif
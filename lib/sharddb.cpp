@@ -0,0 +1,424 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "sharddb.hpp"
+#include "filedb.hpp"
+#include "bsonview.hpp"
+
+#include <variant.hpp>
+#include <bson.hpp>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <experimental/filesystem>
+#include <memory>
+#include <stdexcept>
+#include <sstream>
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+namespace stdfs=std::experimental::filesystem;
+
+static bool valid_key(const string& key)
+{
+    return (key.size() > 0 and key[0] != '.' and key.find('/') == string::npos);
+}
+
+static bool same_value(Variant a, Variant b)
+{
+    if (a.is_int32() and b.is_int32()) {
+        return a.get_int32() == b.get_int32();
+    }
+
+    if (a.is_string() and b.is_string()) {
+        return a.get_string() == b.get_string();
+    }
+
+    return false;
+}
+
+static bool same_unique(const vector<string>& unique, Variant a, Variant b)
+{
+    for (const string& name : unique) {
+        if (same_value(a[name],b[name])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ShardDB::ShardDB() : durability(Durability::Full), held(false)
+{
+}
+
+ShardDB::ShardDB(string path, string magic, string collection, string field, vector<string> unique) : path(path),
+    magic(magic), collection(collection), field(field), unique(unique), durability(Durability::Full),
+    held(false)
+{
+    // keys never start with a dot, so manifest can not clash with a record
+    manifest = FileDB(path + "/.manifest",LLX_GVA_GATE_MANIFEST_MAGIC);
+}
+
+bool ShardDB::exists()
+{
+    return manifest.exists();
+}
+
+void ShardDB::create(uint32_t mode)
+{
+    // directories need search permission wherever files are readable
+    uint32_t dir_mode = mode | ((mode & 0444) >> 2);
+
+    const stdfs::path dbdir {path};
+    stdfs::create_directories(dbdir);
+    chmod(path.c_str(),dir_mode);
+
+    manifest.create(DBFormat::Bson,mode);
+
+    manifest.open();
+    manifest.lock_write();
+
+    Variant data = Variant::create_struct();
+    data["entries"] = Variant::create_array(0);
+    manifest.write(data);
+
+    manifest.unlock();
+    manifest.close();
+}
+
+void ShardDB::set_durability(Durability durability)
+{
+    this->durability = durability;
+    manifest.set_durability(durability);
+}
+
+Variant ShardDB::lock_stats()
+{
+    manifest.open(true);
+    Variant stats = manifest.lock_stats();
+    manifest.close();
+
+    return stats;
+}
+
+Variant ShardDB::read()
+{
+    Variant records = Variant::create_array(0);
+
+    each([&](Variant record) {
+        records.append(record);
+        return true;
+    });
+
+    Variant data = Variant::create_struct();
+    data[collection] = records;
+
+    return data;
+}
+
+void ShardDB::each(function<bool(Variant)> callback)
+{
+    Variant entries;
+
+    {
+        auto lock = lock_manifest(LockMode::Read);
+        entries = manifest.read()["entries"];
+    }
+
+    for (size_t n=0;n<entries.count();n++) {
+        Variant record;
+
+        // record may be gone since manifest was read
+        if (read_record(entries[n]["key"].get_string(),record) and !callback(record)) {
+            break;
+        }
+    }
+}
+
+void ShardDB::write(Variant data)
+{
+    auto lock = lock_manifest(LockMode::Write);
+
+    replace(manifest.read()["entries"],data);
+}
+
+void ShardDB::replace(Variant entries, Variant data)
+{
+    for (size_t n=0;n<entries.count();n++) {
+        unlink(record_path(entries[n]["key"].get_string()).c_str());
+    }
+
+    entries = Variant::create_array(0);
+
+    Variant records = data[collection];
+
+    for (size_t n=0;n<records.count();n++) {
+        Variant record = records[n];
+        string key = record[field].get_string();
+
+        write_record(key,record);
+
+        Variant entry = Variant::create_struct();
+        entry["key"] = key;
+
+        for (string& name : unique) {
+            entry[name] = record[name];
+        }
+
+        entries.append(entry);
+    }
+
+    Variant manifest_data = Variant::create_struct();
+    manifest_data["entries"] = entries;
+    manifest.write(manifest_data);
+}
+
+bool ShardDB::find(const string& key, Variant& out)
+{
+    // such a key could never have been stored
+    if (!valid_key(key)) {
+        return false;
+    }
+
+    /*
+        an upsert crashing before manifest is updated leaves a record file
+        behind that manifest does not list, enumeration skips it and so
+        must we
+    */
+    Variant entry;
+
+    {
+        auto lock = lock_manifest(LockMode::Read);
+
+        if (!manifest.find("entries","key",key,entry)) {
+            return false;
+        }
+    }
+
+    return read_record(key,out);
+}
+
+void ShardDB::upsert(const string& key, Variant value)
+{
+    Variant entry = Variant::create_struct();
+    entry["key"] = key;
+
+    for (string& name : unique) {
+        entry[name] = value[name];
+    }
+
+    {
+        // shared with other upserts, keeps a whole database write out
+        auto lock = lock_manifest(LockMode::Shared);
+        Variant current;
+
+        if (manifest.find("entries","key",key,current)) {
+            bool changed = false;
+
+            for (string& name : unique) {
+                if (!same_value(current[name],entry[name])) {
+                    changed = true;
+                }
+            }
+
+            if (!changed) {
+                // nothing to tell manifest
+                write_record(key,value);
+                return;
+            }
+        }
+    }
+
+    {
+        auto lock = lock_manifest(LockMode::Write);
+
+        write_record(key,value);
+
+        Variant entries = manifest.read()["entries"];
+
+        for (size_t n=0;n<entries.count();n++) {
+            Variant other = entries[n];
+
+            if (other["key"].get_string() != key and same_unique(unique,other,entry)) {
+                unlink(record_path(other["key"].get_string()).c_str());
+            }
+        }
+
+        manifest.upsert("entries","key",key,entry,unique);
+    }
+
+    if (!held) {
+        manifest.compact_if_due();
+    }
+}
+
+void ShardDB::remove(const string& key)
+{
+    {
+        auto lock = lock_manifest(LockMode::Write);
+
+        unlink(record_path(key).c_str());
+        manifest.remove("entries","key",key);
+    }
+
+    if (!held) {
+        manifest.compact_if_due();
+    }
+}
+
+void ShardDB::transaction(function<void()> body)
+{
+    if (held) {
+        body();
+        return;
+    }
+
+    AutoLock lock(LockMode::Write,&manifest);
+    held = true;
+
+    try {
+        body();
+    }
+    catch (std::exception& e) {
+        held = false;
+        throw;
+    }
+
+    held = false;
+}
+
+unique_ptr<AutoLock> ShardDB::lock_manifest(LockMode mode)
+{
+    if (held) {
+        return nullptr;
+    }
+
+    return unique_ptr<AutoLock>(new AutoLock(mode,&manifest));
+}
+
+string ShardDB::record_path(string key)
+{
+    if (!valid_key(key)) {
+        throw runtime_error("ShardDB: Bad key:" + key);
+    }
+
+    return path + "/" + key;
+}
+
+void ShardDB::write_record(string key, Variant value)
+{
+    string target = record_path(key);
+    string tmp_path = path + "/." + key + "." + std::to_string(getpid()) + ".tmp";
+
+    struct stat st;
+
+    if (stat((path + "/.manifest").c_str(),&st) != 0) {
+        stringstream ss;
+        ss<<"Failed to stat ShardDB manifest:"<<path;
+        throw runtime_error(ss.str());
+    }
+
+    Variant header = Variant::create_struct();
+    header["magic"] = magic;
+    header["data"] = value;
+
+    stringstream ss(std::stringstream::out | std::stringstream::binary);
+    bson::dump(header,ss);
+    const string& buffer = ss.str();
+
+    int fd = ::open(tmp_path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,st.st_mode & 07777);
+
+    if (fd < 0) {
+        throw runtime_error("ShardDB: Failed to create record:" + tmp_path);
+    }
+
+    // record keeps owner and mode of manifest, readers are not locked out
+    if (fchown(fd,st.st_uid,st.st_gid) != 0 or fchmod(fd,st.st_mode & 07777) != 0) {
+        ::close(fd);
+        unlink(tmp_path.c_str());
+        throw runtime_error("ShardDB: Failed to set record owner and mode:" + tmp_path);
+    }
+
+    ssize_t len = ::write(fd,buffer.c_str(),buffer.size());
+
+    if (len != (ssize_t)buffer.size()) {
+        ::close(fd);
+        unlink(tmp_path.c_str());
+        throw runtime_error("ShardDB: Failed to write record:" + tmp_path);
+    }
+
+    if (durability != Durability::None) {
+        fsync(fd);
+    }
+
+    ::close(fd);
+
+    if (rename(tmp_path.c_str(),target.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        throw runtime_error("ShardDB: Failed to commit record:" + target);
+    }
+
+    if (durability == Durability::Full) {
+        sync_dir();
+    }
+}
+
+bool ShardDB::read_record(string key, Variant& out)
+{
+    int fd = ::open(record_path(key).c_str(),O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    fstat(fd,&st);
+
+    if (st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* ptr = mmap(nullptr,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+
+    if (ptr == MAP_FAILED) {
+        throw runtime_error("ShardDB: Failed to map record:" + key);
+    }
+
+    try {
+        BsonView header((const char*)ptr,st.st_size);
+
+        if (header["magic"].get_string() != magic) {
+            throw runtime_error("ShardDB read: Bad MAGIC");
+        }
+
+        out = header["data"].to_variant();
+    }
+    catch (std::exception& e) {
+        munmap(ptr,st.st_size);
+        throw;
+    }
+
+    munmap(ptr,st.st_size);
+
+    return true;
+}
+
+void ShardDB::sync_dir()
+{
+    int dir = ::open(path.c_str(),O_RDONLY | O_DIRECTORY);
+
+    if (dir >= 0) {
+        fsync(dir);
+        ::close(dir);
+    }
+}
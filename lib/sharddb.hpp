@@ -0,0 +1,103 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_SHARDDB
+#define LLX_GVA_GATE_SHARDDB
+
+#include "filedb.hpp"
+#include "storage.hpp"
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define LLX_GVA_GATE_MANIFEST_MAGIC "LLX-MANIFEST"
+
+namespace lliurex
+{
+    /*!
+        Directory database storing one record per file, named after its
+        key. A manifest FileDB lists known keys, so enumeration does not
+        depend on directory listing, and is only locked when a key is
+        added, removed or changes any unique field. Updating an already
+        known record only rewrites its own file.
+    */
+    class ShardDB : public Storage
+    {
+        public:
+
+        ShardDB();
+
+        /*!
+            unique fields are kept in manifest too, an upsert drops any
+            other record sharing one of them
+        */
+        ShardDB(std::string path, std::string magic, std::string collection, std::string field,
+                std::vector<std::string> unique = {});
+
+        bool exists();
+        void create(uint32_t mode);
+
+        void set_durability(Durability durability);
+
+        void set_lock_timeout(int32_t timeout)
+        {
+            manifest.set_lock_timeout(timeout);
+        }
+
+        edupals::variant::Variant lock_stats();
+
+        /*!
+            Whole database with the same layout a FileDB would hold,
+            records in a struct array named after collection
+        */
+        edupals::variant::Variant read();
+
+        /*!
+            Replaces whole database
+        */
+        void write(edupals::variant::Variant data);
+
+        void each(std::function<bool(edupals::variant::Variant)> callback);
+
+        bool find(const std::string& key, edupals::variant::Variant& out);
+
+        void upsert(const std::string& key, edupals::variant::Variant value);
+        void remove(const std::string& key);
+
+        /*!
+            Holds manifest write lock while body runs
+        */
+        void transaction(std::function<void()> body);
+
+        protected:
+
+        /*!
+            Locks manifest, unless a transaction already holds it
+        */
+        std::unique_ptr<AutoLock> lock_manifest(LockMode mode);
+
+        std::string record_path(std::string key);
+        void replace(edupals::variant::Variant entries, edupals::variant::Variant data);
+        void write_record(std::string key, edupals::variant::Variant value);
+        bool read_record(std::string key, edupals::variant::Variant& out);
+        void sync_dir();
+
+        std::string path;
+        std::string magic;
+        std::string collection;
+        std::string field;
+        std::vector<std::string> unique;
+        Durability durability;
+        bool held;
+
+        FileDB manifest;
+    };
+}
+
+#endif
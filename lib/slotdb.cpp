@@ -0,0 +1,531 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "slotdb.hpp"
+#include "filedb.hpp"
+
+#include <variant.hpp>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <experimental/filesystem>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using namespace lliurex;
+using namespace lliurex::slots;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+namespace stdfs=std::experimental::filesystem;
+
+/*
+    open file description locks are not released when another descriptor
+    of same file is closed, and are not shared between threads
+*/
+#ifdef F_OFD_SETLK
+#define LLX_GVA_GATE_SETLK F_OFD_SETLK
+#else
+#define LLX_GVA_GATE_SETLK F_SETLK
+#endif
+
+static uint32_t hash_name(const string& name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (char c : name) {
+        hash ^= (uint8_t)c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static off_t slot_offset(uint32_t index)
+{
+    // header takes first slot
+    return (off_t)sizeof(Slot) * (index + 1);
+}
+
+static bool read_slot(int fd, uint32_t index, Slot& slot)
+{
+    ssize_t len = pread(fd,&slot,sizeof(Slot),slot_offset(index));
+
+    if (len != (ssize_t)sizeof(Slot)) {
+        return false;
+    }
+
+    slot.name[sizeof(slot.name) - 1] = 0;
+    slot.key[sizeof(slot.key) - 1] = 0;
+
+    return true;
+}
+
+static Variant slot_value(const Slot& slot)
+{
+    Variant value = Variant::create_struct();
+    value["name"] = string(slot.name);
+    value["key"] = string(slot.key);
+    value["expire"] = slot.expire;
+
+    return value;
+}
+
+static void fill_slot(Slot& slot, const string& name, const string& key, int32_t expire)
+{
+    if (name.size() >= sizeof(slot.name) or key.size() >= sizeof(slot.key)) {
+        throw runtime_error("SlotDB: Record too large:" + name);
+    }
+
+    std::memset(&slot,0,sizeof(Slot));
+    slot.state = State::Used;
+    slot.expire = expire;
+    std::memcpy(slot.name,name.c_str(),name.size());
+    std::memcpy(slot.key,key.c_str(),key.size());
+}
+
+SlotDB::SlotDB() : durability(Durability::Full), lock_timeout(LLX_GVA_GATE_LOCK_TIMEOUT), fd(-1), slot_count(0)
+{
+}
+
+SlotDB::SlotDB(string path, string magic) : path(path), magic(magic), durability(Durability::Full),
+    lock_timeout(LLX_GVA_GATE_LOCK_TIMEOUT), fd(-1), slot_count(0)
+{
+}
+
+SlotDB::~SlotDB()
+{
+    close();
+}
+
+bool SlotDB::exists()
+{
+    const stdfs::path dbpath {path};
+
+    return stdfs::exists(dbpath);
+}
+
+void SlotDB::create(uint32_t mode)
+{
+    Variant passwords = Variant::create_array(0);
+    rebuild(passwords,LLX_GVA_GATE_SLOT_COUNT);
+
+    chmod(path.c_str(),mode);
+}
+
+Variant SlotDB::read()
+{
+    Variant passwords = Variant::create_array(0);
+
+    open();
+
+    // every slot at once, so no record is seen half written
+    lock(fd,F_RDLCK,slot_offset(0),0);
+
+    for (uint32_t n=0;n<slot_count;n++) {
+        Slot slot;
+
+        if (!read_slot(fd,n,slot)) {
+            unlock(fd,slot_offset(0),0);
+            throw runtime_error("SlotDB: Failed to read:" + path);
+        }
+
+        if (slot.state == State::Used) {
+            passwords.append(slot_value(slot));
+        }
+    }
+
+    unlock(fd,slot_offset(0),0);
+
+    Variant data = Variant::create_struct();
+    data["passwords"] = passwords;
+
+    return data;
+}
+
+void SlotDB::write(Variant data)
+{
+    Variant passwords = data["passwords"];
+
+    if (!passwords.is_array()) {
+        passwords = Variant::create_array(0);
+    }
+
+    uint32_t count = LLX_GVA_GATE_SLOT_COUNT;
+
+    while (count < passwords.count() * 2) {
+        count = count * 2;
+    }
+
+    while (true) {
+        open();
+        lock(fd,F_WRLCK,0,sizeof(Slot));
+
+        if (is_current()) {
+            break;
+        }
+
+        // table was rebuilt while we waited
+        unlock(fd,0,sizeof(Slot));
+        close();
+    }
+
+    try {
+        rebuild(passwords,count);
+    }
+    catch (std::exception& e) {
+        unlock(fd,0,sizeof(Slot));
+        close();
+        throw;
+    }
+
+    unlock(fd,0,sizeof(Slot));
+    close();
+}
+
+bool SlotDB::find(const string& name, Variant& out)
+{
+    if (name.size() >= sizeof(Slot::name)) {
+        return false;
+    }
+
+    open();
+
+    uint32_t start = hash_name(name) % slot_count;
+
+    for (uint32_t n=0;n<slot_count;n++) {
+        uint32_t index = (start + n) % slot_count;
+        Slot slot;
+
+        lock(fd,F_RDLCK,slot_offset(index),sizeof(Slot));
+        bool status = read_slot(fd,index,slot);
+        unlock(fd,slot_offset(index),sizeof(Slot));
+
+        if (!status) {
+            throw runtime_error("SlotDB: Failed to read:" + path);
+        }
+
+        if (slot.state == State::Empty) {
+            return false;
+        }
+
+        if (name == slot.name) {
+            out = slot_value(slot);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SlotDB::upsert(const string& name, const string& key, int32_t expire)
+{
+    Slot record;
+    fill_slot(record,name,key,expire);
+
+    while (true) {
+        open();
+
+        // shared with every other slot writer, only a rebuild excludes us
+        lock(fd,F_RDLCK,0,sizeof(Slot));
+
+        if (!is_current()) {
+            unlock(fd,0,sizeof(Slot));
+            close();
+            continue;
+        }
+
+        uint32_t start = hash_name(name) % slot_count;
+        uint32_t probes = std::min<uint32_t>(slot_count,LLX_GVA_GATE_SLOT_PROBES);
+        bool done = false;
+
+        for (uint32_t n=0;n<probes and !done;n++) {
+            uint32_t index = (start + n) % slot_count;
+            off_t offset = slot_offset(index);
+            Slot slot;
+
+            lock(fd,F_WRLCK,offset,sizeof(Slot));
+
+            if (!read_slot(fd,index,slot)) {
+                unlock(fd,offset,sizeof(Slot));
+                unlock(fd,0,sizeof(Slot));
+                throw runtime_error("SlotDB: Failed to read:" + path);
+            }
+
+            /*
+                records are never removed one by one, so first empty slot
+                ends the chain and name can not be further away
+            */
+            if (slot.state == State::Empty or name == slot.name) {
+                ssize_t len = pwrite(fd,&record,sizeof(Slot),offset);
+
+                if (len == (ssize_t)sizeof(Slot) and durability != Durability::None) {
+                    fdatasync(fd);
+                }
+
+                unlock(fd,offset,sizeof(Slot));
+
+                if (len != (ssize_t)sizeof(Slot)) {
+                    unlock(fd,0,sizeof(Slot));
+                    throw runtime_error("SlotDB: Failed to write:" + path);
+                }
+
+                done = true;
+            }
+            else {
+                unlock(fd,offset,sizeof(Slot));
+            }
+        }
+
+        unlock(fd,0,sizeof(Slot));
+
+        if (done) {
+            return;
+        }
+
+        // chain is too long, table is rebuilt twice as large
+        lock(fd,F_WRLCK,0,sizeof(Slot));
+
+        if (is_current()) {
+            uint32_t count = slot_count * 2;
+            Variant passwords = Variant::create_array(0);
+
+            for (uint32_t n=0;n<slot_count;n++) {
+                Slot slot;
+
+                if (read_slot(fd,n,slot) and slot.state == State::Used) {
+                    passwords.append(slot_value(slot));
+                }
+            }
+
+            try {
+                rebuild(passwords,count);
+            }
+            catch (std::exception& e) {
+                unlock(fd,0,sizeof(Slot));
+                close();
+                throw;
+            }
+        }
+
+        unlock(fd,0,sizeof(Slot));
+        close();
+    }
+}
+
+void SlotDB::open()
+{
+    if (fd != -1 and is_current()) {
+        return;
+    }
+
+    close();
+
+    fd = ::open(path.c_str(),O_RDWR);
+
+    if (fd < 0) {
+        fd = ::open(path.c_str(),O_RDONLY);
+    }
+
+    if (fd < 0) {
+        throw runtime_error("SlotDB: Failed to open:" + path);
+    }
+
+    Header header;
+    ssize_t len = pread(fd,&header,sizeof(Header),0);
+
+    if (len != (ssize_t)sizeof(Header) or header.signature != Signature) {
+        close();
+        throw runtime_error("SlotDB: Bad signature:" + path);
+    }
+
+    header.magic[sizeof(header.magic) - 1] = 0;
+
+    if (header.version != Version or header.slot_size != sizeof(Slot) or
+        header.slot_count == 0 or magic != header.magic) {
+        close();
+        throw runtime_error("SlotDB: Bad header:" + path);
+    }
+
+    slot_count = header.slot_count;
+}
+
+void SlotDB::close()
+{
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+        slot_count = 0;
+    }
+}
+
+bool SlotDB::is_current()
+{
+    struct stat current;
+    struct stat st;
+
+    if (fstat(fd,&current) != 0 or stat(path.c_str(),&st) != 0) {
+        return false;
+    }
+
+    return (current.st_ino == st.st_ino and current.st_dev == st.st_dev);
+}
+
+void SlotDB::lock(int fd, short type, off_t start, off_t len)
+{
+    struct flock fl;
+    std::memset(&fl,0,sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(lock_timeout);
+    useconds_t backoff = 1000;
+
+    while (fcntl(fd,LLX_GVA_GATE_SETLK,&fl) != 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno != EAGAIN and errno != EACCES) {
+            throw runtime_error("SlotDB: Failed to lock:" + path);
+        }
+
+        if (lock_timeout > 0 and std::chrono::steady_clock::now() >= deadline) {
+            throw exception::LockTimeout("SlotDB: Timed out waiting for lock:" + path);
+        }
+
+        usleep(backoff);
+        backoff = std::min<useconds_t>(backoff * 2,50000);
+    }
+}
+
+void SlotDB::unlock(int fd, off_t start, off_t len)
+{
+    struct flock fl;
+    std::memset(&fl,0,sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    fcntl(fd,LLX_GVA_GATE_SETLK,&fl);
+}
+
+void SlotDB::rebuild(Variant passwords, uint32_t count)
+{
+    vector<Slot> table(count);
+    std::memset(table.data(),0,sizeof(Slot) * count);
+
+    for (size_t n=0;n<passwords.count();n++) {
+        Variant entry = passwords[n];
+        string name = entry["name"].get_string();
+        uint32_t start = hash_name(name) % count;
+
+        for (uint32_t m=0;m<count;m++) {
+            Slot& slot = table[(start + m) % count];
+
+            // a later record for same name wins
+            if (slot.state == State::Empty or name == slot.name) {
+                fill_slot(slot,name,entry["key"].get_string(),entry["expire"].get_int32());
+                break;
+            }
+        }
+    }
+
+    Slot first;
+    std::memset(&first,0,sizeof(Slot));
+
+    Header* header = (Header*)&first;
+    header->signature = Signature;
+    header->version = Version;
+    header->slot_count = count;
+    header->slot_size = sizeof(Slot);
+    std::strncpy(header->magic,magic.c_str(),sizeof(header->magic) - 1);
+
+    // new table keeps owner and mode of current one
+    struct stat st;
+    bool known = (fd != -1 and fstat(fd,&st) == 0);
+
+    // unique name, two writers growing table never share a temp file
+    string tmp_path = path + ".XXXXXX";
+    vector<char> name(tmp_path.begin(),tmp_path.end());
+    name.push_back(0);
+
+    int out = mkstemp(name.data());
+
+    if (out < 0) {
+        throw runtime_error("SlotDB: Failed to create:" + tmp_path);
+    }
+
+    tmp_path = name.data();
+
+    if (known and (fchown(out,st.st_uid,st.st_gid) != 0 or fchmod(out,st.st_mode & 07777) != 0)) {
+        ::close(out);
+        unlink(tmp_path.c_str());
+        throw runtime_error("SlotDB: Failed to set owner and mode:" + tmp_path);
+    }
+
+    const char* ptr = (const char*)&first;
+    size_t remain = sizeof(Slot);
+    bool table_done = false;
+
+    while (true) {
+        if (remain == 0) {
+            if (table_done) {
+                break;
+            }
+
+            ptr = (const char*)table.data();
+            remain = sizeof(Slot) * count;
+            table_done = true;
+            continue;
+        }
+
+        ssize_t len = ::write(out,ptr,remain);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ::close(out);
+            unlink(tmp_path.c_str());
+            throw runtime_error("SlotDB: Failed to write:" + tmp_path);
+        }
+
+        ptr += len;
+        remain -= len;
+    }
+
+    if (durability != Durability::None) {
+        fsync(out);
+    }
+
+    ::close(out);
+
+    if (rename(tmp_path.c_str(),path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        throw runtime_error("SlotDB: Failed to commit:" + path);
+    }
+
+    if (durability == Durability::Full) {
+        const stdfs::path dbpath {path};
+        int dir = ::open(dbpath.parent_path().c_str(),O_RDONLY | O_DIRECTORY);
+
+        if (dir >= 0) {
+            fsync(dir);
+            ::close(dir);
+        }
+    }
+}
@@ -0,0 +1,134 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_SLOTDB
+#define LLX_GVA_GATE_SLOTDB
+
+#include "filedb.hpp"
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <string>
+
+/*
+    Slotted shadow database layout, little endian:
+
+    Header              padded to one slot
+    Slot[slot_count]    open addressing table by name hash
+
+    Header range is locked shared by slot writers and exclusive when
+    table is rebuilt. Each slot is locked on its own, so updates of
+    different users do not wait for each other.
+*/
+
+/* probes before a table is considered too crowded and grown */
+#define LLX_GVA_GATE_SLOT_PROBES 32
+
+/* slots of a newly created table */
+#define LLX_GVA_GATE_SLOT_COUNT 1024
+
+namespace lliurex
+{
+    namespace slots
+    {
+        const uint32_t Signature = 0x53584c4c; // LLXS
+        const uint32_t Version = 1;
+
+        enum State : uint32_t
+        {
+            Empty = 0,
+            Used = 1
+        };
+
+        struct Header
+        {
+            uint32_t signature;
+            uint32_t version;
+            uint32_t slot_count;
+            uint32_t slot_size;
+            char magic[32];
+        };
+
+        struct Slot
+        {
+            uint32_t state;
+            int32_t expire;
+            char name[64];
+            char key[184];
+        };
+    }
+
+    class SlotDB
+    {
+        public:
+
+        SlotDB();
+        SlotDB(std::string path, std::string magic);
+        virtual ~SlotDB();
+
+        /*!
+            Whether name fits in a slot, longer ones can not be stored
+        */
+        static bool fits(const std::string& name)
+        {
+            return name.size() < sizeof(slots::Slot::name);
+        }
+
+        bool exists();
+        void create(uint32_t mode);
+
+        void set_durability(Durability durability)
+        {
+            this->durability = durability;
+        }
+
+        void set_lock_timeout(int32_t timeout)
+        {
+            this->lock_timeout = timeout;
+        }
+
+        /*!
+            Whole database with the same layout shadow FileDB holds
+        */
+        edupals::variant::Variant read();
+
+        /*!
+            Replaces whole database, table is sized for its records
+        */
+        void write(edupals::variant::Variant data);
+
+        /*!
+            Only locks the slots being probed
+        */
+        bool find(const std::string& name, edupals::variant::Variant& out);
+
+        /*!
+            Rewrites one slot under its own lock, table is only locked
+            exclusively when it has to grow
+        */
+        void upsert(const std::string& name, const std::string& key, int32_t expire);
+
+        protected:
+
+        void open();
+        void close();
+        bool is_current();
+
+        void lock(int fd, short type, off_t start, off_t len);
+        void unlock(int fd, off_t start, off_t len);
+
+        void rebuild(edupals::variant::Variant passwords, uint32_t count);
+
+        std::string path;
+        std::string magic;
+        Durability durability;
+        int32_t lock_timeout;
+
+        int fd;
+        uint32_t slot_count;
+    };
+}
+
+#endif
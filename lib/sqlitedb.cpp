@@ -0,0 +1,505 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "sqlitedb.hpp"
+#include "filedb.hpp"
+
+#include <variant.hpp>
+#include <bson.hpp>
+
+#include <sqlite3.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <climits>
+#include <memory>
+#include <stdexcept>
+#include <sstream>
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+
+using Statement = std::unique_ptr<sqlite3_stmt,int(*)(sqlite3_stmt*)>;
+
+static string encode(Variant value)
+{
+    stringstream ss(std::stringstream::out | std::stringstream::binary);
+    bson::dump(value,ss);
+
+    return ss.str();
+}
+
+static Variant decode(sqlite3_stmt* stmt, int column)
+{
+    const char* data = (const char*)sqlite3_column_blob(stmt,column);
+    size_t size = sqlite3_column_bytes(stmt,column);
+
+    MemoryBuffer buffer(data,size);
+    istream ss(&buffer);
+
+    return bson::load(ss);
+}
+
+static string quote(string name)
+{
+    return "\"" + name + "\"";
+}
+
+SqliteDB::SqliteDB() : durability(Durability::Full), lock_timeout(LLX_GVA_GATE_LOCK_TIMEOUT),
+    db(nullptr), read_only(true), owner(nullptr), depth(0)
+{
+}
+
+SqliteDB::SqliteDB(string path, string magic, string collection, string field, vector<string> columns,
+                   vector<string> unique) : path(path), magic(magic), collection(collection), field(field),
+    columns(columns), unique(unique), durability(Durability::Full), lock_timeout(LLX_GVA_GATE_LOCK_TIMEOUT),
+    db(nullptr), read_only(true), owner(nullptr), depth(0)
+{
+}
+
+SqliteDB::SqliteDB(const SqliteDB& other) : path(other.path), magic(other.magic),
+    collection(other.collection), field(other.field), columns(other.columns), unique(other.unique),
+    durability(other.durability), lock_timeout(other.lock_timeout), db(nullptr), read_only(true),
+    owner(other.owner), depth(0)
+{
+}
+
+SqliteDB& SqliteDB::operator=(const SqliteDB& other)
+{
+    // connections are never shared
+    close();
+
+    path = other.path;
+    magic = other.magic;
+    collection = other.collection;
+    field = other.field;
+    columns = other.columns;
+    unique = other.unique;
+    durability = other.durability;
+    lock_timeout = other.lock_timeout;
+    owner = other.owner;
+    depth = 0;
+
+    return *this;
+}
+
+SqliteDB::~SqliteDB()
+{
+    close();
+}
+
+bool SqliteDB::exists()
+{
+    struct stat st;
+
+    return (stat(path.c_str(),&st) == 0);
+}
+
+void SqliteDB::create(uint32_t mode)
+{
+    // tables sharing a file create it once, an existing one is never removed
+    bool created = !exists();
+
+    // write-ahead log and shared memory files inherit this mode
+    int fd = ::open(path.c_str(),O_WRONLY | O_CREAT,mode);
+
+    if (fd < 0) {
+        throw runtime_error("SqliteDB: Failed to create database:" + path);
+    }
+
+    if (fchmod(fd,mode) != 0) {
+        ::close(fd);
+
+        if (created) {
+            unlink(path.c_str());
+        }
+
+        throw runtime_error("SqliteDB: Failed to set database mode:" + path);
+    }
+
+    ::close(fd);
+
+    open(false);
+    setup();
+}
+
+void SqliteDB::set_durability(Durability durability)
+{
+    this->durability = durability;
+
+    if (db != nullptr and !read_only) {
+        set_synchronous();
+    }
+}
+
+void SqliteDB::set_lock_timeout(int32_t timeout)
+{
+    this->lock_timeout = timeout;
+
+    if (db != nullptr) {
+        // zero disables busy handler, we want it to wait forever instead
+        sqlite3_busy_timeout(db,(lock_timeout > 0) ? lock_timeout : INT_MAX);
+    }
+}
+
+Variant SqliteDB::lock_stats()
+{
+    return Variant::create_struct();
+}
+
+Variant SqliteDB::read()
+{
+    Variant records = Variant::create_array(0);
+
+    each([&](Variant record) {
+        records.append(record);
+        return true;
+    });
+
+    Variant data = Variant::create_struct();
+    data[collection] = records;
+
+    return data;
+}
+
+void SqliteDB::write(Variant data)
+{
+    open();
+
+    transaction([&]() {
+        exec("DELETE FROM " + quote(collection));
+
+        Variant records = data[collection];
+
+        for (size_t n=0;n<records.count();n++) {
+            Variant record = records[n];
+
+            insert(record[field].get_string(),record);
+        }
+    });
+}
+
+void SqliteDB::each(function<bool(Variant)> callback)
+{
+    open();
+
+    Statement stmt(prepare("SELECT record FROM " + quote(collection) + " ORDER BY rowid"),sqlite3_finalize);
+
+    while (true) {
+        int status = sqlite3_step(stmt.get());
+
+        if (status == SQLITE_DONE) {
+            break;
+        }
+
+        if (status != SQLITE_ROW) {
+            fail("Failed to read records");
+        }
+
+        if (!callback(decode(stmt.get(),0))) {
+            break;
+        }
+    }
+}
+
+bool SqliteDB::find(const string& key, Variant& out)
+{
+    open();
+
+    Statement stmt(prepare("SELECT record FROM " + quote(collection) + " WHERE key = ?"),sqlite3_finalize);
+    sqlite3_bind_text(stmt.get(),1,key.c_str(),key.size(),SQLITE_TRANSIENT);
+
+    int status = sqlite3_step(stmt.get());
+
+    if (status == SQLITE_DONE) {
+        return false;
+    }
+
+    if (status != SQLITE_ROW) {
+        fail("Failed to find record");
+    }
+
+    out = decode(stmt.get(),0);
+
+    return true;
+}
+
+void SqliteDB::upsert(const string& key, Variant value)
+{
+    open();
+
+    transaction([&]() {
+        for (string& name : unique) {
+            if (!value[name].is_int32()) {
+                continue;
+            }
+
+            Statement stmt(prepare("DELETE FROM " + quote(collection) + " WHERE " + quote(name) +
+                                   " = ? AND key <> ?"),sqlite3_finalize);
+
+            sqlite3_bind_int(stmt.get(),1,value[name].get_int32());
+            sqlite3_bind_text(stmt.get(),2,key.c_str(),key.size(),SQLITE_TRANSIENT);
+            step(stmt.get());
+        }
+
+        insert(key,value);
+    });
+}
+
+void SqliteDB::remove(const string& key)
+{
+    open();
+
+    Statement stmt(prepare("DELETE FROM " + quote(collection) + " WHERE key = ?"),sqlite3_finalize);
+    sqlite3_bind_text(stmt.get(),1,key.c_str(),key.size(),SQLITE_TRANSIENT);
+    step(stmt.get());
+}
+
+void SqliteDB::compact()
+{
+    open();
+
+    if (!read_only) {
+        exec("PRAGMA wal_checkpoint(TRUNCATE)");
+    }
+}
+
+void SqliteDB::open(bool verify)
+{
+    // owner may have reopened since, handle is never kept from it
+    if (owner != nullptr) {
+        owner->open(verify);
+
+        db = owner->db;
+        read_only = owner->read_only;
+
+        return;
+    }
+
+    if (db != nullptr) {
+        return;
+    }
+
+    /*
+        falls back to read only when file is write protected, a reader
+        still gets to a WAL database while its -wal and -shm files exist
+    */
+    if (sqlite3_open_v2(path.c_str(),&db,SQLITE_OPEN_READWRITE,nullptr) != SQLITE_OK) {
+        string what = (db != nullptr) ? sqlite3_errmsg(db) : "out of memory";
+        close();
+
+        throw runtime_error("SqliteDB: Failed to open database:" + path + ":" + what);
+    }
+
+    read_only = (sqlite3_db_readonly(db,"main") == 1);
+
+    set_lock_timeout(lock_timeout);
+
+    if (!read_only) {
+        // keep -wal and -shm around, so unprivileged readers can open it
+        int persist = 1;
+        sqlite3_file_control(db,"main",SQLITE_FCNTL_PERSIST_WAL,&persist);
+
+        set_synchronous();
+    }
+
+    if (verify) {
+        try {
+            check_magic();
+        }
+        catch (std::exception& e) {
+            close();
+            throw;
+        }
+    }
+}
+
+void SqliteDB::close()
+{
+    if (owner != nullptr) {
+        db = nullptr;
+        return;
+    }
+
+    if (db != nullptr) {
+        sqlite3_close(db);
+        db = nullptr;
+    }
+}
+
+void SqliteDB::setup()
+{
+    if (read_only) {
+        throw runtime_error("SqliteDB: Database is read only:" + path);
+    }
+
+    exec("PRAGMA journal_mode=WAL");
+    exec("CREATE TABLE IF NOT EXISTS meta (name TEXT PRIMARY KEY, value TEXT)");
+
+    string sql = "CREATE TABLE IF NOT EXISTS " + quote(collection) + " (key TEXT PRIMARY KEY";
+
+    for (string& name : columns) {
+        sql += ", " + quote(name) + " INTEGER";
+    }
+
+    sql += ", record BLOB NOT NULL)";
+    exec(sql);
+
+    for (string& name : columns) {
+        exec("CREATE INDEX IF NOT EXISTS " + quote(collection + "_" + name) + " ON " +
+             quote(collection) + " (" + quote(name) + ")");
+    }
+
+    Statement stmt(prepare("INSERT OR IGNORE INTO meta (name, value) VALUES ('magic', ?)"),sqlite3_finalize);
+    sqlite3_bind_text(stmt.get(),1,magic.c_str(),magic.size(),SQLITE_TRANSIENT);
+    step(stmt.get());
+
+    check_magic();
+}
+
+/*!
+    Synchronous mode is not stored in database, every connection sets it
+*/
+void SqliteDB::set_synchronous()
+{
+    switch (durability) {
+        case Durability::Full:
+            exec("PRAGMA synchronous=FULL");
+        break;
+
+        // commits are consistent, last ones may be lost until checkpoint
+        case Durability::File:
+            exec("PRAGMA synchronous=NORMAL");
+        break;
+
+        case Durability::None:
+            exec("PRAGMA synchronous=OFF");
+        break;
+    }
+}
+
+void SqliteDB::check_magic()
+{
+    Statement stmt(prepare("SELECT value FROM meta WHERE name = 'magic'"),sqlite3_finalize);
+
+    if (sqlite3_step(stmt.get()) != SQLITE_ROW or
+        string((const char*)sqlite3_column_text(stmt.get(),0)) != magic) {
+        throw runtime_error("SqliteDB: Bad MAGIC");
+    }
+}
+
+void SqliteDB::exec(string sql)
+{
+    if (sqlite3_exec(db,sql.c_str(),nullptr,nullptr,nullptr) != SQLITE_OK) {
+        fail("Failed to run " + sql);
+    }
+}
+
+sqlite3_stmt* SqliteDB::prepare(string sql)
+{
+    sqlite3_stmt* stmt = nullptr;
+
+    if (sqlite3_prepare_v2(db,sql.c_str(),sql.size(),&stmt,nullptr) != SQLITE_OK) {
+        fail("Failed to prepare " + sql);
+    }
+
+    return stmt;
+}
+
+void SqliteDB::step(sqlite3_stmt* stmt)
+{
+    int status = sqlite3_step(stmt);
+
+    if (status != SQLITE_DONE and status != SQLITE_ROW) {
+        fail("Failed to run statement");
+    }
+}
+
+void SqliteDB::fail(string what)
+{
+    int status = sqlite3_errcode(db);
+
+    if (status == SQLITE_BUSY or status == SQLITE_LOCKED) {
+        throw exception::LockTimeout("SqliteDB: Timed out waiting for database lock:" + path);
+    }
+
+    if (status == SQLITE_READONLY) {
+        throw runtime_error("SqliteDB: Database is read only:" + path);
+    }
+
+    throw runtime_error("SqliteDB: " + what + ":" + sqlite3_errmsg(db));
+}
+
+void SqliteDB::transaction(function<void()> body)
+{
+    open();
+
+    SqliteDB* base = (owner != nullptr) ? owner : this;
+
+    if (base->depth > 0) {
+        body();
+        return;
+    }
+
+    // takes write lock upfront, so it never has to be upgraded
+    exec("BEGIN IMMEDIATE");
+    base->depth++;
+
+    try {
+        body();
+    }
+    catch (std::exception& e) {
+        base->depth--;
+        sqlite3_exec(db,"ROLLBACK",nullptr,nullptr,nullptr);
+        throw;
+    }
+
+    base->depth--;
+    exec("COMMIT");
+}
+
+void SqliteDB::share(SqliteDB* owner)
+{
+    close();
+
+    this->owner = owner;
+}
+
+void SqliteDB::insert(string key, Variant value)
+{
+    string sql = "INSERT OR REPLACE INTO " + quote(collection) + " (key";
+    string params = "?";
+
+    for (string& name : columns) {
+        sql += ", " + quote(name);
+        params += ", ?";
+    }
+
+    sql += ", record) VALUES (" + params + ", ?)";
+
+    Statement stmt(prepare(sql),sqlite3_finalize);
+    const string buffer = encode(value);
+    int index = 1;
+
+    sqlite3_bind_text(stmt.get(),index++,key.c_str(),key.size(),SQLITE_TRANSIENT);
+
+    for (string& name : columns) {
+        if (value[name].is_int32()) {
+            sqlite3_bind_int(stmt.get(),index,value[name].get_int32());
+        }
+        else {
+            sqlite3_bind_null(stmt.get(),index);
+        }
+
+        index++;
+    }
+
+    sqlite3_bind_blob(stmt.get(),index,buffer.c_str(),buffer.size(),SQLITE_TRANSIENT);
+    step(stmt.get());
+}
@@ -0,0 +1,120 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_SQLITEDB
+#define LLX_GVA_GATE_SQLITEDB
+
+#include "filedb.hpp"
+#include "storage.hpp"
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace lliurex
+{
+    /*!
+        Collection stored as a table of an SQLite database in WAL mode,
+        readers see last committed state and never block a writer.
+
+        Records are kept as BSON next to their key and a column for each
+        indexed Int32 field. Several collections may share one file, each
+        of them with its own table, and may share a connection so they
+        commit together.
+    */
+    class SqliteDB : public Storage
+    {
+        public:
+
+        SqliteDB();
+
+        /*!
+            unique fields must be among columns, an upsert drops any other
+            record sharing one of them
+        */
+        SqliteDB(std::string path, std::string magic, std::string collection, std::string field,
+                 std::vector<std::string> columns = {}, std::vector<std::string> unique = {});
+
+        SqliteDB(const SqliteDB& other);
+        SqliteDB& operator=(const SqliteDB& other);
+
+        virtual ~SqliteDB();
+
+        bool exists();
+        void create(uint32_t mode);
+
+        void set_durability(Durability durability);
+        void set_lock_timeout(int32_t timeout);
+
+        /*!
+            Locking is left to SQLite, there are no counters to show
+        */
+        edupals::variant::Variant lock_stats();
+
+        edupals::variant::Variant read();
+        void write(edupals::variant::Variant data);
+        void each(std::function<bool(edupals::variant::Variant)> callback);
+
+        bool find(const std::string& key, edupals::variant::Variant& out);
+
+        void upsert(const std::string& key, edupals::variant::Variant value);
+        void remove(const std::string& key);
+
+        /*!
+            Runs body inside a single write transaction, taken upfront.
+            Nested ones join outermost, and so do collections sharing its
+            connection
+        */
+        void transaction(std::function<void()> body);
+
+        /*!
+            Goes through owner connection from now on, owner must be a
+            collection in the same file and outlive this one
+        */
+        void share(SqliteDB* owner);
+
+        /*!
+            Checkpoints write-ahead log into database file and truncates it
+        */
+        void compact();
+
+        protected:
+
+        void open(bool verify = true);
+        void close();
+        void setup();
+        void set_synchronous();
+        void check_magic();
+
+        void exec(std::string sql);
+        sqlite3_stmt* prepare(std::string sql);
+        void step(sqlite3_stmt* stmt);
+        void fail(std::string what);
+
+        void insert(std::string key, edupals::variant::Variant value);
+
+        std::string path;
+        std::string magic;
+        std::string collection;
+        std::string field;
+        std::vector<std::string> columns;
+        std::vector<std::string> unique;
+        Durability durability;
+        int32_t lock_timeout;
+
+        sqlite3* db;
+        bool read_only;
+
+        SqliteDB* owner;
+        int depth;
+    };
+}
+
+#endif
@@ -0,0 +1,73 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_STORAGE
+#define LLX_GVA_GATE_STORAGE
+
+#include "filedb.hpp"
+
+#include <variant.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace lliurex
+{
+    /*!
+        Keyed collection of struct records, implemented by per-record
+        backends. Whole database goes in and out with the same layout a
+        FileDB holds, records in a struct array named after collection
+    */
+    class Storage
+    {
+        public:
+
+        virtual ~Storage()
+        {
+        }
+
+        virtual bool exists() = 0;
+        virtual void create(uint32_t mode) = 0;
+
+        virtual void set_durability(Durability durability) = 0;
+        virtual void set_lock_timeout(int32_t timeout) = 0;
+
+        virtual edupals::variant::Variant lock_stats() = 0;
+
+        virtual edupals::variant::Variant read() = 0;
+
+        /*!
+            Replaces whole database
+        */
+        virtual void write(edupals::variant::Variant data) = 0;
+
+        /*!
+            Calls back every record, iteration stops when callback
+            returns false
+        */
+        virtual void each(std::function<bool(edupals::variant::Variant)> callback) = 0;
+
+        virtual bool find(const std::string& key, edupals::variant::Variant& out) = 0;
+
+        virtual void upsert(const std::string& key, edupals::variant::Variant value) = 0;
+        virtual void remove(const std::string& key) = 0;
+
+        /*!
+            Runs body as a single step, no other writer gets in between.
+            Calls made from body on this storage join it
+        */
+        virtual void transaction(std::function<void()> body) = 0;
+
+        /*!
+            Folds pending changes into main storage, nothing to do unless
+            backend keeps a log
+        */
+        virtual void compact()
+        {
+        }
+    };
+}
+
+#endif
@@ -20,6 +20,9 @@
 #include <chrono>
 #include <functional>
 
+/* NSS callers should rather retry than hang, in milliseconds */
+#define LLX_GVA_GATE_NSS_LOCK_TIMEOUT 1000
+
 using namespace edupals;
 using namespace edupals::variant;
 
@@ -69,6 +72,9 @@ namespace lliurex
 
     bool debug = false;
 
+    // last reload timed out, cached entries are outdated
+    bool stale = false;
+
     lliurex::Observer observer;
 }
 
@@ -181,6 +187,7 @@ int update_db()
 {
 
     lliurex::Gate gate(log);
+    gate.set_lock_timeout(LLX_GVA_GATE_NSS_LOCK_TIMEOUT);
 
     if (!gate.exists_db()) {
         // this may happen
@@ -189,7 +196,7 @@ int update_db()
 
     try {
 
-        if (!lliurex::observer.changed()) {
+        if (!lliurex::observer.changed() and !lliurex::stale) {
             return 0;
         }
 
@@ -231,11 +238,19 @@ int update_db()
         }
 
     }
+    catch (lliurex::exception::LockTimeout& e) {
+        // caller may try again instead of hanging a login
+        syslog(LOG_WARNING,"Timed out waiting for user database\n");
+        lliurex::stale = true;
+        return -2;
+    }
     catch (...) {
         syslog(LOG_ERR,"Failed to open user database\n");
         return -1;
     }
 
+    lliurex::stale = false;
+
     return 0;
 }
 
@@ -250,6 +265,10 @@ nss_status _nss_llxgvagate_setgrent(void)
     lliurex::index = -1;
 
     int db_status = update_db();
+    if (db_status == -2) {
+        return NSS_STATUS_TRYAGAIN;
+    }
+
     if (db_status == -1) {
         return NSS_STATUS_UNAVAIL;
     }
@@ -295,6 +314,11 @@ nss_status _nss_llxgvagate_getgrgid_r(gid_t gid, struct group* result, char* buf
     std::lock_guard<std::mutex> lock(lliurex::mtx);
 
     int db_status = update_db();
+    if (db_status == -2) {
+        *errnop = EAGAIN;
+        return NSS_STATUS_TRYAGAIN;
+    }
+
     if (db_status == -1) {
         *errnop = ENOENT;
         return NSS_STATUS_UNAVAIL;
@@ -323,6 +347,11 @@ nss_status _nss_llxgvagate_getgrnam_r(const char* name, struct group* result, ch
     std::lock_guard<std::mutex> lock(lliurex::mtx);
 
     int db_status = update_db();
+    if (db_status == -2) {
+        *errnop = EAGAIN;
+        return NSS_STATUS_TRYAGAIN;
+    }
+
     if (db_status == -1) {
         *errnop = ENOENT;
         return NSS_STATUS_UNAVAIL;
@@ -354,6 +383,10 @@ enum nss_status _nss_llxgvagate_setpwent(int stayopen)
     lliurex::pindex = -1;
 
     int db_status = update_db();
+    if (db_status == -2) {
+        return NSS_STATUS_TRYAGAIN;
+    }
+
     if (db_status == -1) {
         return NSS_STATUS_UNAVAIL;
     }
@@ -396,6 +429,11 @@ enum nss_status _nss_llxgvagate_getpwuid_r(uid_t uid, struct passwd* result, cha
     std::lock_guard<std::mutex> lock(lliurex::pmtx);
 
     int db_status = update_db();
+    if (db_status == -2) {
+        *errnop = EAGAIN;
+        return NSS_STATUS_TRYAGAIN;
+    }
+
     if (db_status == -1) {
         return NSS_STATUS_UNAVAIL;
     }
@@ -421,6 +459,11 @@ enum nss_status _nss_llxgvagate_getpwnam_r(const char* name, struct passwd* resu
     std::lock_guard<std::mutex> lock(lliurex::pmtx);
 
     int db_status = update_db();
+    if (db_status == -2) {
+        *errnop = EAGAIN;
+        return NSS_STATUS_TRYAGAIN;
+    }
+
     if (db_status == -1) {
         return NSS_STATUS_UNAVAIL;
     }
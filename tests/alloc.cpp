@@ -0,0 +1,160 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+/*
+    Heap allocations per lookup once database snapshot is loaded. Bounds
+    are ceilings, meant to catch a lookup going back to parsing or
+    copying whole database, not an exact count
+*/
+
+#include "check.hpp"
+
+#include <libllxgvagate.hpp>
+
+#include <variant.hpp>
+
+#include <pwd.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <experimental/filesystem>
+#include <iostream>
+#include <new>
+#include <string>
+
+#define LLX_GVA_GATE_TEST_LOOKUPS 1000
+#define LLX_GVA_GATE_TEST_GROUPS 8
+
+#define LLX_GVA_GATE_TEST_PWNAM_ALLOCS 32
+#define LLX_GVA_GATE_TEST_USER_ALLOCS 256
+#define LLX_GVA_GATE_TEST_PASSWORD_ALLOCS 64
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+namespace stdfs=std::experimental::filesystem;
+
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1,std::memory_order_relaxed);
+
+    void* ptr = std::malloc(size ? size : 1);
+
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static Variant create_group(const string& name, int32_t gid)
+{
+    Variant group = Variant::create_struct();
+    group["name"] = name;
+    group["gid"] = gid;
+
+    return group;
+}
+
+static Variant create_user(const string& login, int32_t uid)
+{
+    Variant user = Variant::create_struct();
+    user["login"] = login;
+    user["uid"] = uid;
+    user["gid"] = create_group("users",(int32_t)100);
+    user["name"] = "Test";
+    user["surname"] = "User";
+    user["home"] = "/home/" + login;
+    user["shell"] = "/bin/bash";
+    user["groups"] = Variant::create_array(0);
+
+    for (int32_t n=0;n<LLX_GVA_GATE_TEST_GROUPS;n++) {
+        user["groups"].append(create_group("group" + std::to_string(n),2000 + n));
+    }
+
+    return user;
+}
+
+/*
+    Average allocations of one call to lookup, after a warm up call
+*/
+template <class F>
+static double count(F lookup)
+{
+    lookup();
+
+    size_t start = allocations.load();
+
+    for (size_t n=0;n<LLX_GVA_GATE_TEST_LOOKUPS;n++) {
+        lookup();
+    }
+
+    return (double)(allocations.load() - start) / LLX_GVA_GATE_TEST_LOOKUPS;
+}
+
+int main(int argc, char* argv[])
+{
+    stdfs::remove_all(LLX_GVA_GATE_DB_PATH);
+
+    Gate gate([](int priority, string message) {
+        if (priority <= LOG_WARNING) {
+            std::cerr<<message;
+        }
+    });
+
+    gate.create_db();
+
+    for (int32_t n=0;n<100;n++) {
+        gate.update_db(create_user("user" + std::to_string(n),10000 + n));
+    }
+
+    gate.update_shadow_db("user42","secret");
+
+    struct passwd info;
+    CHECK(gate.get_pwnam("user42",&info));
+    CHECK(info.pw_uid == 10042);
+
+    Variant user;
+    gate.lookup_user("user42",user);
+    CHECK(user["gid"].is_struct());
+    CHECK(user["groups"].count() == LLX_GVA_GATE_TEST_GROUPS);
+    CHECK(user["groups"][0]["gid"].is_int32());
+
+    double pwnam = count([&]() {
+        gate.get_pwnam("user42",&info);
+    });
+
+    double lookup = count([&]() {
+        Variant out;
+        gate.lookup_user("user42",out);
+    });
+
+    double password = count([&]() {
+        gate.lookup_password("user42","secret");
+    });
+
+    std::cout<<"allocations per get_pwnam: "<<pwnam<<std::endl;
+    std::cout<<"allocations per lookup_user: "<<lookup<<std::endl;
+    std::cout<<"allocations per lookup_password: "<<password<<std::endl;
+
+    CHECK(pwnam <= LLX_GVA_GATE_TEST_PWNAM_ALLOCS);
+    CHECK(lookup <= LLX_GVA_GATE_TEST_USER_ALLOCS);
+    CHECK(password <= LLX_GVA_GATE_TEST_PASSWORD_ALLOCS);
+
+    return EXIT_SUCCESS;
+}
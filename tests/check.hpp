@@ -0,0 +1,22 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#ifndef LLX_GVA_GATE_TESTS_CHECK
+#define LLX_GVA_GATE_TESTS_CHECK
+
+#include <cstdlib>
+#include <iostream>
+
+/*
+    Stops test at first failed check, ctest only looks at exit status
+*/
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr<<__FILE__<<":"<<__LINE__<<": check failed: "<<#condition<<std::endl; \
+            std::exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#endif
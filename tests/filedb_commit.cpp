@@ -0,0 +1,133 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+/*
+    Several processes queueing and committing at once, as a login storm
+    does, with journal folded under them. No update may be lost
+*/
+
+#include "check.hpp"
+
+#include <filedb.hpp>
+
+#include <variant.hpp>
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <experimental/filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define LLX_GVA_GATE_TEST_WRITERS 8
+#define LLX_GVA_GATE_TEST_UPDATES 50
+
+/* small enough to get journal folded several times meanwhile */
+#define LLX_GVA_GATE_TEST_JOURNAL_LIMIT 4096
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+namespace stdfs=std::experimental::filesystem;
+
+static string login_of(int writer, int update)
+{
+    return "user" + std::to_string(writer) + "-" + std::to_string(update);
+}
+
+static int writer(const string& path, int id)
+{
+    try {
+        FileDB db(path,"LLX-TEST");
+        db.set_durability(Durability::None);
+        db.set_journal_limit(LLX_GVA_GATE_TEST_JOURNAL_LIMIT);
+
+        for (int n=0;n<LLX_GVA_GATE_TEST_UPDATES;n++) {
+            Variant user = Variant::create_struct();
+            user["login"] = login_of(id,n);
+            user["writer"] = (int32_t)id;
+
+            string ticket = db.queue_upsert("users","login",login_of(id,n),user);
+
+            {
+                AutoLock lock(LockMode::Write,&db);
+                db.commit(ticket);
+            }
+
+            db.compact_if_due();
+        }
+    }
+    catch (std::exception& e) {
+        std::cerr<<"writer "<<id<<": "<<e.what()<<std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[])
+{
+    char name[] = "/tmp/llx-gva-gate-test.XXXXXX";
+    CHECK(mkdtemp(name) != nullptr);
+
+    string dir = name;
+    string path = dir + "/test.db";
+
+    {
+        FileDB db(path,"LLX-TEST");
+        db.create(DBFormat::Bson,0600);
+
+        Variant data = Variant::create_struct();
+        data["users"] = Variant::create_array(0);
+
+        AutoLock lock(LockMode::Write,&db);
+        db.write(data);
+    }
+
+    vector<pid_t> children;
+
+    for (int n=0;n<LLX_GVA_GATE_TEST_WRITERS;n++) {
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+
+        if (pid == 0) {
+            _exit(writer(path,n));
+        }
+
+        children.push_back(pid);
+    }
+
+    for (pid_t pid : children) {
+        int status;
+        CHECK(waitpid(pid,&status,0) == pid);
+        CHECK(WIFEXITED(status) and WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    FileDB db(path,"LLX-TEST");
+
+    {
+        AutoLock lock(LockMode::Read,&db);
+        CHECK(db.read()["users"].count() == LLX_GVA_GATE_TEST_WRITERS * LLX_GVA_GATE_TEST_UPDATES);
+
+        for (int w=0;w<LLX_GVA_GATE_TEST_WRITERS;w++) {
+            for (int n=0;n<LLX_GVA_GATE_TEST_UPDATES;n++) {
+                Variant user;
+                CHECK(db.find("users","login",login_of(w,n),user));
+                CHECK(user["writer"].get_int32() == w);
+            }
+        }
+    }
+
+    // every ticket got committed, nothing is left queued
+    CHECK(!stdfs::exists(path + ".pending") or stdfs::file_size(path + ".pending") == 0);
+
+    stdfs::remove_all(dir);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+// SPDX-FileCopyrightText: 2026 Enrique M.G. <quique@necos.es>
+//
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+/*
+    Journal left behind by a crash: one from a fold that never removed
+    it, and one with a record only half written
+*/
+
+#include "check.hpp"
+
+#include <filedb.hpp>
+
+#include <variant.hpp>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+using namespace lliurex;
+using namespace edupals;
+using namespace edupals::variant;
+
+using namespace std;
+namespace stdfs=std::experimental::filesystem;
+
+static string load_file(const string& path)
+{
+    std::ifstream file(path,std::ios::binary);
+
+    return string(std::istreambuf_iterator<char>(file),std::istreambuf_iterator<char>());
+}
+
+static void save_file(const string& path, const string& data, bool append = false)
+{
+    std::ofstream file(path,std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+    file<<data;
+}
+
+static void upsert(FileDB& db, const string& login, int32_t value)
+{
+    Variant user = Variant::create_struct();
+    user["login"] = login;
+    user["value"] = value;
+
+    AutoLock lock(LockMode::Write,&db);
+    db.upsert("users","login",login,user);
+}
+
+static void compact(FileDB& db)
+{
+    AutoLock lock(LockMode::Write,&db);
+    db.compact();
+}
+
+static int32_t value_of(FileDB& db, const string& login)
+{
+    AutoLock lock(LockMode::Read,&db);
+    Variant user;
+
+    if (!db.find("users","login",login,user)) {
+        return -1;
+    }
+
+    return user["value"].get_int32();
+}
+
+static size_t count(FileDB& db)
+{
+    AutoLock lock(LockMode::Read,&db);
+
+    return db.read()["users"].count();
+}
+
+int main(int argc, char* argv[])
+{
+    char name[] = "/tmp/llx-gva-gate-test.XXXXXX";
+    CHECK(mkdtemp(name) != nullptr);
+
+    string dir = name;
+    string path = dir + "/test.db";
+    string journal = path + ".journal";
+
+    FileDB db(path,"LLX-TEST");
+    db.set_durability(Durability::None);
+    db.create(DBFormat::Bson,0600);
+
+    {
+        Variant data = Variant::create_struct();
+        data["users"] = Variant::create_array(0);
+
+        AutoLock lock(LockMode::Write,&db);
+        db.write(data);
+    }
+
+    // fold that crashed after renaming new base, before removing journal
+    upsert(db,"alice",1);
+    string stale = load_file(journal);
+    CHECK(stale.size() > 0);
+
+    // keeps old base inode from being reused by a later base file
+    CHECK(link(path.c_str(),(dir + "/old.db").c_str()) == 0);
+
+    compact(db);
+    CHECK(!stdfs::exists(journal));
+
+    upsert(db,"alice",2);
+    compact(db);
+
+    save_file(journal,stale);
+
+    CHECK(value_of(db,"alice") == 2);
+    CHECK(count(db) == 1);
+
+    // next writer drops it instead of appending after it
+    upsert(db,"bob",3);
+    CHECK(value_of(db,"alice") == 2);
+    CHECK(value_of(db,"bob") == 3);
+    CHECK(count(db) == 2);
+
+    // record cut short by a crashed writer
+    upsert(db,"carol",4);
+    size_t complete = load_file(journal).size();
+
+    save_file(journal,string("\x40\x00\x00\x00\x03op\x00",8),true);
+
+    CHECK(value_of(db,"carol") == 4);
+    CHECK(count(db) == 3);
+
+    // torn tail is cut off before appending, nothing after it is lost
+    upsert(db,"dave",5);
+    CHECK(load_file(journal).size() > complete);
+    CHECK(value_of(db,"carol") == 4);
+    CHECK(value_of(db,"dave") == 5);
+    CHECK(count(db) == 4);
+
+    compact(db);
+    CHECK(value_of(db,"alice") == 2);
+    CHECK(value_of(db,"dave") == 5);
+    CHECK(count(db) == 4);
+
+    stdfs::remove_all(dir);
+
+    return EXIT_SUCCESS;
+}